@@ -13,9 +13,12 @@
 #include "mqtt.h"
 #include "ota.h"
 #include "ntp.h"
+#include "rgb_pwm.h"
+#include "timeline.h"
 
 // -- Configuration specific key. The value should be modified if config structure was changed.
-const char IOTWC_CONFIG_VERSION[] = "BADRGB_002";
+//      IotWebConf compares IOTWEBCONF_CONFIG_VERSION_LENGTH characters of it, see platformio.ini.
+const char IOTWC_CONFIG_VERSION[] = "BADRGB_012";
 
 // -- When BUTTON_PIN is pulled to ground on startup, the Thing will use the initial
 //      password to build an AP. (E.g. in case of lost password)
@@ -40,6 +43,7 @@ const char wifiInitialApPassword[] = "12345678";
 // -- Method declarations.
 void iotWebConfConvertStringParameters(void);
 void handleRoot(void);
+void handleEffects(void);
 
 // Callback method declarations - find implementation after IotWebConf initialization
 void wifiConnected();
@@ -94,6 +98,48 @@ iotwebconf::NumberParameter iotNtpTzOffset = iotwebconf::NumberParameter(
     ntpTzOffset, NTP_TZ_OFFSET_STR_LEN,
     ntpTzOffset, "Timezone Value", "min='-12' max='12' step='1'");
 
+iotwebconf::ParameterGroup iotGroupRgb = iotwebconf::ParameterGroup("groupRGB", "RGB Panel");
+iotwebconf::NumberParameter iotRgbStrips = iotwebconf::NumberParameter(
+    "Number of strips", "rgbStrips",
+    rgbStrips, RGB_STRIPS_STR_LEN,
+    rgbStrips, "densely packed from PCA 0x40 on", "min='1' max='48' step='1'");
+iotwebconf::TextParameter iotRgbTopology = iotwebconf::TextParameter(
+    "Strip topology", "rgbTopology",
+    rgbTopology, RGB_TOPOLOGY_STR_LEN,
+    rgbTopology, "addr:r/g/b per strip, e.g. 40:0 40:3/4/5", "");
+iotwebconf::NumberParameter iotRgbIicMaxFreq = iotwebconf::NumberParameter(
+    "Max IIC clock", "rgbIicMaxFreq",
+    rgbIicMaxFreq, RGB_IIC_MAX_FREQ_STR_LEN,
+    rgbIicMaxFreq, "in kHz, qualified on boot", "min='100' max='1000' step='100'");
+iotwebconf::TextParameter iotRgbCurve = iotwebconf::TextParameter(
+    "Output curve", "rgbCurve",
+    rgbCurve, RGB_CURVE_STR_LEN,
+    rgbCurve, "linear, gamma22, gamma28 or cie", "");
+iotwebconf::TextParameter iotRgbCalib = iotwebconf::TextParameter(
+    "Colour calibration", "rgbCalib",
+    rgbCalib, RGB_CALIB_STR_LEN,
+    rgbCalib, "per batch r,g,b or 3x3 in 1/1000, /max r,g,b; batch by @n in topology", "");
+iotwebconf::NumberParameter iotRgbBrightnessRamp = iotwebconf::NumberParameter(
+    "Brightness ramp", "rgbBrightnessRamp",
+    rgbBrightnessRamp, RGB_BRIGHTNESS_RAMP_STR_LEN,
+    rgbBrightnessRamp, "in milliseconds, 0 jumps", "min='0' max='60000' step='1'");
+iotwebconf::NumberParameter iotRgbPowerBudget = iotwebconf::NumberParameter(
+    "Power budget", "rgbPowerBudget",
+    rgbPowerBudget, RGB_POWER_BUDGET_STR_LEN,
+    rgbPowerBudget, "in mA, frames above are scaled down, 0 is off", "min='0' max='65535' step='1'");
+iotwebconf::TextParameter iotRgbChannelCurrent = iotwebconf::TextParameter(
+    "Channel current", "rgbChannelCurrent",
+    rgbChannelCurrent, RGB_CHANNEL_CURRENT_STR_LEN,
+    rgbChannelCurrent, "r,g,b in mA of one strip at full duty", "");
+iotwebconf::TextParameter iotRgbPwmFreq = iotwebconf::TextParameter(
+    "PWM frequency", "rgbPwmFreq",
+    rgbPwmFreq, RGB_PWM_FREQ_STR_LEN,
+    rgbPwmFreq, "default, camera, highspeed or 24..1526 Hz", "");
+iotwebconf::TextParameter iotRgbTimeline = iotwebconf::TextParameter(
+    "Timeline file", "rgbTimeline",
+    timeline::timelineFile, timeline::TIMELINE_FILE_STR_LEN,
+    timeline::timelineFile, "path on LittleFS", "");
+
 //
 // Called from main setup
 //
@@ -117,6 +163,18 @@ void setupIotWebConf()
   iotGroupNtp.addItem(&iotNtpTzOffset);
   iotWebConf.addParameterGroup(&iotGroupNtp);
 
+  iotGroupRgb.addItem(&iotRgbStrips);
+  iotGroupRgb.addItem(&iotRgbTopology);
+  iotGroupRgb.addItem(&iotRgbIicMaxFreq);
+  iotGroupRgb.addItem(&iotRgbCurve);
+  iotGroupRgb.addItem(&iotRgbCalib);
+  iotGroupRgb.addItem(&iotRgbBrightnessRamp);
+  iotGroupRgb.addItem(&iotRgbPowerBudget);
+  iotGroupRgb.addItem(&iotRgbChannelCurrent);
+  iotGroupRgb.addItem(&iotRgbPwmFreq);
+  iotGroupRgb.addItem(&iotRgbTimeline);
+  iotWebConf.addParameterGroup(&iotGroupRgb);
+
   iotWebConf.setStatusPin(IOTWC_STATUS_PIN);
   iotWebConf.setConfigPin(IOTWC_BUTTON_PIN);
 
@@ -159,6 +217,7 @@ void setupIotWebConf()
 
   // Set up required URL handlers on the web server
   webServer.on("/", handleRoot);
+  webServer.on("/effects", handleEffects);
   //  webServer.on("/boot", handleBoot);
   webServer.on("/config", [] { iotWebConf.handleConfig(); });
   webServer.onNotFound([]() { iotWebConf.handleNotFound(); });
@@ -220,11 +279,88 @@ void handleRoot()
   s += F("<li>Timezone: ");
   s += ntpTzOffset;
 
-  s += F("</ul>Go to <a href='config'>configure page</a> to change values.</body></html>\n");
+  s += F("</ul><h1>RGB settings</h1><ul><li>Strips: ");
+  s += rgbStrips;
+  s += F("<li>Topology: ");
+  s += rgbTopology;
+  s += F("<li>Max IIC clock: ");
+  s += rgbIicMaxFreq;
+  s += F("<li>Output curve: ");
+  s += rgbCurve;
+  s += F("<li>Colour calibration: ");
+  s += rgbCalib;
+  s += F("<li>Brightness ramp: ");
+  s += rgbBrightnessRamp;
+  s += F("<li>Power budget: ");
+  s += rgbPowerBudget;
+  s += F("<li>Channel current: ");
+  s += rgbChannelCurrent;
+  s += F("<li>PWM frequency: ");
+  s += rgbPwmFreq;
+  s += F("<li>Timeline file: ");
+  s += timeline::timelineFile;
+
+  s += F("</ul>Go to <a href='config'>configure page</a> to change values, ");
+  s += F("<a href='effects'>effects page</a> to select an effect.</body></html>\n");
 
   webServer.send(200, "text/html", s);
 } // handleRoot
 
+//
+// List the effects of the registry. A POST of select=<name> selects
+// one, a GET never changes the panel.
+//
+void handleEffects()
+{
+  if (iotWebConf.handleCaptivePortal())
+  {
+    // Let IotWebConf test and handle captive portal requests.
+    return;
+  }
+
+  if (webServer.method() == HTTP_POST && webServer.hasArg("select"))
+  {
+    int8_t i = effectIndexRGB(webServer.arg("select").c_str());
+    if (i >= 0)
+      setModeRGB(i);
+  }
+
+  effect_st e;
+  effect_param_st p;
+
+  String s = F("<!DOCTYPE html><html lang=\"en\"><head><meta name=\"viewport\" content=\"width=device-width, initial-scale=1, user-scalable=no\"/><title>");
+  s += appName;
+  s += F("</title></head><body><h1>Effects</h1><ul>");
+
+  for (uint8_t i = 0; getEffectRGB(i, &e); i++)
+  {
+    s += F("<li><form method='post' action='effects' style='display:inline'><button name='select' value='");
+    s += FPSTR(e.name);
+    s += F("'>");
+    s += FPSTR(e.name);
+    s += F("</button></form>");
+    if (i == currentEffectRGB())
+      s += F(" (running)");
+    s += F(", ~");
+    s += effectCostRGB(i);
+    s += F("us/frame");
+
+    for (uint8_t k = 0; getEffectParamRGB(i, k, &p); k++)
+    {
+      s += F(", ");
+      s += FPSTR(p.name);
+      s += ' ';
+      s += p.min;
+      s += F("..");
+      s += p.max;
+    }
+  }
+
+  s += F("</ul>Go to <a href='/'>home page</a>.</body></html>\n");
+
+  webServer.send(200, "text/html", s);
+} // handleEffects
+
 //
 // Request a reboot of the device.
 //
@@ -257,7 +393,25 @@ void configSaved()
 } // configSaved
 
 //
-// ToDo: validate configuration parameters.
+// Check a number of the form against min..max, flag the parameter if not.
+//
+static bool validateNumber(iotwebconf::Parameter *param, const char *id, long min, long max, const char *msg)
+{
+  String v = webServer.arg(id);
+  char *end;
+  long n = strtol(v.c_str(), &end, 10);
+
+  if (v.length() == 0 || *end || n < min || n > max)
+  {
+    param->errorMessage = msg;
+    return false;
+  }
+  return true;
+} // validateNumber
+
+//
+// Validate configuration parameters. configSaved reboots into them, so
+// the RGB Panel ones are checked by the same parsers that apply them.
 //
 bool formValidator()
 {
@@ -265,7 +419,41 @@ bool formValidator()
 
   bool valid = true;
 
-  // check for digits in numeric values?
+  valid = validateNumber(&iotRgbStrips, "rgbStrips", 1, 48, "1..48 strips") && valid;
+  // strips only counts without a topology
+  if (!checkTopologyRGB(atoi(webServer.arg("rgbStrips").c_str()), webServer.arg("rgbTopology").c_str()))
+  {
+    iotRgbTopology.errorMessage = "Invalid topology, too many PCAs or a channel used twice";
+    valid = false;
+  }
+  valid = validateNumber(&iotRgbIicMaxFreq, "rgbIicMaxFreq", 100, 1000, "100..1000 kHz") && valid;
+  if (!checkCurveRGB(webServer.arg("rgbCurve").c_str()))
+  {
+    iotRgbCurve.errorMessage = "linear, gamma22, gamma28 or cie";
+    valid = false;
+  }
+  if (!checkCalibRGB(webServer.arg("rgbCalib").c_str()))
+  {
+    iotRgbCalib.errorMessage = "Invalid calibration";
+    valid = false;
+  }
+  valid = validateNumber(&iotRgbBrightnessRamp, "rgbBrightnessRamp", 0, 60000, "0..60000 ms") && valid;
+  valid = validateNumber(&iotRgbPowerBudget, "rgbPowerBudget", 0, 65535, "0..65535 mA") && valid;
+  if (!checkChannelCurrentRGB(webServer.arg("rgbChannelCurrent").c_str()))
+  {
+    iotRgbChannelCurrent.errorMessage = "r,g,b up to 10000 mA";
+    valid = false;
+  }
+  if (!checkPwmFreqRGB(webServer.arg("rgbPwmFreq").c_str()))
+  {
+    iotRgbPwmFreq.errorMessage = "default, camera, highspeed or 24..1526 Hz";
+    valid = false;
+  }
+  if (!webServer.arg("rgbTimeline").startsWith("/"))
+  {
+    iotRgbTimeline.errorMessage = "Absolute path on LittleFS, e.g. /timeline.btl";
+    valid = false;
+  }
 
   return valid;
 } // formValidator
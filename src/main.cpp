@@ -15,6 +15,7 @@
 #include "ota.h"
 #include "ntp.h"
 #include "rgb_pwm.h"
+#include "timeline.h"
 
 //----------------------------------------------------------------------
 // DoubleResetDetector configuration
@@ -110,6 +111,8 @@ void setup()
   Serial << F("SPIFFS done.") << endl;
 */
   
+  timeline::setupTimeline();
+
   setupRgb();
 
   Serial << F("Heap: ") << system_get_free_heap_size() << endl;
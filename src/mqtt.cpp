@@ -44,13 +44,31 @@
 
     /set
       /mode
+      /param/<name>
+      /layers
       /brightness
+      /brightnessRamp
+      /powerBudget
       /speed
+      /fps
+      /cloudHold
+      /cloudDuration
+      /timeline
+      /timelineSeek
+      /topology
+      /sync
+      /stagger
+      /timedOutput
+      /dither
+      /curve
+      /calib
+      /pwmFreq
+      /iicFreq
       /beep
 
 */
 
-const uint16_t MQTT_BUFFER_SIZE = 256;
+const uint16_t MQTT_BUFFER_SIZE = 1024;
 
 char mqttServer[MQTT_SERVER_STR_LEN] = "127.0.0.1";
 
@@ -73,10 +91,11 @@ bool mqttTimeTopicSet = false;
 // wifiConnected callback indicates that MQTT can now connect to the broker
 bool mqttNeedConnect = false;
 
-//MQTTClient mqttClient(MQTT_BUFFER_SIZE);
-MQTTClient mqttClient(256);
+MQTTClient mqttClient(MQTT_BUFFER_SIZE);
 
 void mqttSendHeartbeat();
+void mqttSendRgbTelemetry();
+void mqttSendEffects();
 void mqttMessageReceived(String &, String &);
 
 //
@@ -142,6 +161,9 @@ bool connectMqtt() {
     mqttClient.subscribe(s);
     Serial << F("MQTT subscribe to ") << s << endl;
   }
+
+  mqttSendEffects();
+
   return true;
 } // connectMqtt
 
@@ -205,11 +227,113 @@ void mqttSendHeartbeat() {
     if (! rc) {
       Serial << F("MQTT publish error: ") << mqttClient.lastError() << ':' << mqttClient.returnCode() << endl;
     }
+
+    mqttSendRgbTelemetry();
+
     mqttNextHeartbeat = _now + mqttHeartbeatIntervalInt;
   }
   
 } // mqttSendHeartbeat
 
+//
+// Send telemetry of the RGB engine along with the heartbeat
+//
+void mqttSendRgbTelemetry() {
+
+  String topic = mqttTopicPraefix;
+  topic += "/info/rgb";
+
+  const int jsonCapacity = JSON_OBJECT_SIZE(10) + JSON_OBJECT_SIZE(8) + JSON_OBJECT_SIZE(2) + JSON_ARRAY_SIZE(IIC_FREQ_STEPS) + IIC_FREQ_STEPS * JSON_OBJECT_SIZE(2);
+  StaticJsonDocument<jsonCapacity> doc;
+
+  doc["iicFreq"] = rgbTelemetry.iicFreq;
+  doc["iicErrors"] = rgbTelemetry.iicErrors;
+
+  JsonArray qual = doc.createNestedArray("iicQual");
+  for (uint8_t i = 0; i < IIC_FREQ_STEPS; i++) {
+    if (rgbTelemetry.iicQualErrors[i] == IIC_NOT_QUALIFIED)
+      continue;
+    JsonObject step = qual.createNestedObject();
+    step["kHz"] = iicFreqSteps[i];
+    step["errors"] = rgbTelemetry.iicQualErrors[i];
+  }
+
+  JsonObject out = doc.createNestedObject("output");
+  out["frames"] = rgbTelemetry.outFrames;
+  out["underruns"] = rgbTelemetry.outUnderruns;
+  out["minUs"] = rgbTelemetry.outMinUs;
+  out["p99Us"] = outIntervalP99RGB();
+  out["maxUs"] = rgbTelemetry.outMaxUs;
+  out["txUs"] = rgbTelemetry.txLastUs;
+  out["txMaxUs"] = rgbTelemetry.txMaxUs;
+
+  JsonObject power = doc.createNestedObject("power");
+  power["peakMa"] = rgbTelemetry.powerPeakMa;
+  power["throttled"] = rgbTelemetry.powerThrottled;
+
+  String json;
+  serializeJson(doc, json); 
+  Serial << F("MQTT send rgb telemetry [") << topic << F("] with ") << json.length() << F(" bytes:\n") << json << endl;
+
+  bool rc = mqttClient.publish(topic, json);
+
+  if (! rc) {
+    Serial << F("MQTT publish error: ") << mqttClient.lastError() << ':' << mqttClient.returnCode() << endl;
+  }
+
+} // mqttSendRgbTelemetry
+
+//
+// Publish the effect registry, retained, so clients can offer the
+// effects and their parameters
+//
+void mqttSendEffects() {
+
+  String topic = mqttTopicPraefix;
+  topic += "/info/effects";
+
+  effect_st e;
+  effect_param_st p;
+  uint8_t count = effectCountRGB();
+
+  size_t jsonCapacity = JSON_ARRAY_SIZE(count);
+  for (uint8_t i = 0; getEffectRGB(i, &e); i++)
+    jsonCapacity += JSON_OBJECT_SIZE(5) + JSON_ARRAY_SIZE(e.paramCount) + e.paramCount * JSON_OBJECT_SIZE(3) + (1 + e.paramCount) * 16 + 2;
+  DynamicJsonDocument doc(jsonCapacity);
+
+  JsonArray list = doc.to<JsonArray>();
+  for (uint8_t i = 0; i < count; i++) {
+    getEffectRGB(i, &e);
+
+    char key[2] = { e.key, '\0' };
+
+    JsonObject effect = list.createNestedObject();
+    effect["name"] = FPSTR(e.name);
+    effect["key"] = key;
+    effect["stepDelay"] = e.stepDelay;
+    effect["costUs"] = effectCostRGB(i);
+
+    JsonArray params = effect.createNestedArray("params");
+    for (uint8_t k = 0; getEffectParamRGB(i, k, &p); k++) {
+      JsonObject param = params.createNestedObject();
+      param["name"] = FPSTR(p.name);
+      param["min"] = p.min;
+      param["max"] = p.max;
+    }
+  }
+
+  String json;
+  serializeJson(doc, json); 
+  Serial << F("MQTT send effects [") << topic << F("] with ") << json.length() << F(" bytes:\n") << json << endl;
+
+  bool rc = mqttClient.publish(topic, json, true, 0);
+
+  if (! rc) {
+    Serial << F("MQTT publish error: ") << mqttClient.lastError() << ':' << mqttClient.returnCode() << endl;
+  }
+
+} // mqttSendEffects
+
 typedef struct _pack {
     char year[5];
     char month[3];
@@ -297,14 +421,91 @@ void mqttMessageReceived(String &topic, String &data) {
     }
 
     if ( topic.startsWith(F("mode")) ) {
-      // -2: prev, -1: next, >=0: abs
-      int8_t v = strtoul(data.c_str(), NULL, 10);
+      // -2: prev, -1: next, >=0: abs, or the name of an effect, see /info/effects
+
+      if ( data.length() == 0 )
+        return;
+
+      int8_t v;
+      if ( isDigit( data[0] ) || data[0] == '-' ) {
+        v = strtol(data.c_str(), NULL, 10);
+      } else {
+        v = effectIndexRGB(data.c_str());
+        if ( v < 0 ) {
+          Serial << F("MQTT unknown mode: ") << data << endl;
+          return;
+        }
+      }
 
       Serial << F("MQTT set new mode: ") << v << endl;
       setModeRGB(v);
       return;
     }
 
+    if ( topic.startsWith("param/") ) {
+      // Parameter of the current effect, see /info/effects
+
+      if ( data.length() == 0 )
+        return;
+
+      topic.remove(0, 6);
+      uint16_t v = strtoul(data.c_str(), NULL, 10);
+      Serial << F("MQTT set effect parameter ") << topic << F(": ") << v << endl;
+      setEffectParamRGB(topic.c_str(), v);
+      return;
+    }
+
+    if ( topic.startsWith("layers") ) {
+      // Accent layers on top of the mode, replaces all of them. [] clears.
+      // [{"effect":"wave","first":0,"count":3,"opacity":128,"blend":"add"}, ...]
+      // Not persisted
+
+      const int jsonCapacity = JSON_ARRAY_SIZE(4) + 4 * JSON_OBJECT_SIZE(5);
+      StaticJsonDocument<jsonCapacity> doc;
+
+      DeserializationError err = deserializeJson(doc, data);
+      if (err) {
+        Serial << F("MQTT layers: ") << err.c_str() << endl;
+        return;
+      }
+
+      clearLayersRGB();
+
+      JsonArray layers = doc.as<JsonArray>();
+      for (uint8_t i = 0; i < layers.size(); i++) {
+        JsonObject l = layers[i];
+        if ( !setLayerRGB(i + 1, l["effect"] | "", l["first"] | 0, l["count"] | 255, l["opacity"] | 255, l["blend"] | "normal") )
+          return;
+      }
+      return;
+    }
+
+    if ( topic.startsWith(F("brightnessRamp")) ) {
+      // Time in ms a brightness change takes, 0: jump
+      // Not persisted, use the config page for that
+
+      if ( data.length() == 0 )
+        return;
+
+      uint16_t v = strtoul(data.c_str(), NULL, 10);
+      Serial << F("MQTT set brightness ramp: ") << v << endl;
+      setBrightnessRampRGB(v);
+      return;
+    }
+
+    if ( topic.startsWith(F("powerBudget")) ) {
+      // Current limit of a frame in mA, 0: off
+      // Not persisted, use the config page for that
+
+      if ( data.length() == 0 )
+        return;
+
+      uint16_t v = strtoul(data.c_str(), NULL, 10);
+      Serial << F("MQTT set power budget: ") << v << endl;
+      setPowerBudgetRGB(v);
+      return;
+    }
+
     if ( topic.startsWith(F("intensity")) ) {
       // -n, 0..255, +n
 
@@ -338,7 +539,7 @@ void mqttMessageReceived(String &topic, String &data) {
     }
     
     if ( topic.startsWith("speed") ) {
-      // -n, 0..255, +n
+      // -n, 0..6000, +n in 0.1 hue cycles per minute, independent of fps
 
       if ( data.length() == 0 )
         return;
@@ -347,7 +548,7 @@ void mqttMessageReceived(String &topic, String &data) {
       bool absolute = isDigit( data[0] );
 
       if (absolute) {
-        uint8_t v = strtoul(data.c_str(), NULL, 10);
+        uint16_t v = strtoul(data.c_str(), NULL, 10);
         Serial << F("MQTT set new speed: ") << v << endl;
         setAbsoluteSpeedRGB(v);
         return;
@@ -361,6 +562,179 @@ void mqttMessageReceived(String &topic, String &data) {
       return;
     } 
 
+    if ( topic.startsWith("fps") ) {
+      // 0..255 frames per second, 0: as fast as possible
+
+      if ( data.length() == 0 )
+        return;
+
+      // Wider than setFpsRGB takes, so out of range values do not wrap
+      uint32_t v = strtoul(data.c_str(), NULL, 10);
+      if ( v > 255 ) {
+        Serial << F("MQTT fps out of range 0..255: ") << data << endl;
+        return;
+      }
+      Serial << F("MQTT set new fps: ") << v << endl;
+      setFpsRGB(v);
+      return;
+    }
+
+    if ( topic.startsWith("cloudHold") ) {
+      // 0..65535 ms pause after each cloud fade
+
+      if ( data.length() == 0 )
+        return;
+
+      uint16_t v = strtoul(data.c_str(), NULL, 10);
+      Serial << F("MQTT set new cloud hold: ") << v << endl;
+      setCloudHoldRGB(v);
+      return;
+    }
+
+    if ( topic.startsWith("cloudDuration") ) {
+      // 1..65535 ms per cloud fade, independent of fps
+
+      if ( data.length() == 0 )
+        return;
+
+      uint16_t v = strtoul(data.c_str(), NULL, 10);
+      Serial << F("MQTT set new cloud fade duration: ") << v << endl;
+      setCloudDurationRGB(v);
+      return;
+    }
+
+    if ( topic.startsWith("iicFreq") ) {
+      // Max IIC clock in kHz, bus is requalified up to it
+
+      if ( data.length() == 0 )
+        return;
+
+      uint16_t v = strtoul(data.c_str(), NULL, 10);
+      Serial << F("MQTT set max IIC clock: ") << v << endl;
+      setIicMaxFreqRGB(v);
+      return;
+    }
+
+    if ( topic.startsWith("sync") ) {
+      // 0: each PCA latches on its own STOP, 1: all PCAs latch together
+
+      if ( data.length() == 0 )
+        return;
+
+      uint8_t v = strtoul(data.c_str(), NULL, 10);
+      Serial << F("MQTT set sync output: ") << v << endl;
+      setSyncOutputRGB(v != 0);
+      return;
+    }
+
+    if ( topic.startsWith("stagger") ) {
+      // 0: all channels switch on at 0, 1: phases spread over the period
+
+      if ( data.length() == 0 )
+        return;
+
+      uint8_t v = strtoul(data.c_str(), NULL, 10);
+      Serial << F("MQTT set phase stagger: ") << v << endl;
+      setPhaseStaggerRGB(v != 0);
+      return;
+    }
+
+    if ( topic.startsWith("timedOutput") ) {
+      // 0: frames go out at the end of the loop, 1: a Ticker sends them
+
+      if ( data.length() == 0 )
+        return;
+
+      uint8_t v = strtoul(data.c_str(), NULL, 10);
+      Serial << F("MQTT set timed output: ") << v << endl;
+      setTimedOutputRGB(v != 0);
+      return;
+    }
+
+    if ( topic.startsWith("dither") ) {
+      // Dither channels below this 12 bit value over time, 0: off
+
+      if ( data.length() == 0 )
+        return;
+
+      uint16_t v = strtoul(data.c_str(), NULL, 10);
+      Serial << F("MQTT set dither: ") << v << endl;
+      setDitherRGB(v);
+      return;
+    }
+
+    if ( topic.startsWith("curve") ) {
+      // Output curve: linear, gamma22, gamma28, cie
+      // Not persisted, use the config page for that
+
+      if ( data.length() == 0 )
+        return;
+
+      Serial << F("MQTT set output curve: ") << data << endl;
+      setCurveRGB(data.c_str());
+      return;
+    }
+
+    if ( topic.startsWith("pwmFreq") ) {
+      // PWM frequency: default, camera, highspeed or Hz
+      // Not persisted, use the config page for that
+
+      if ( data.length() == 0 )
+        return;
+
+      Serial << F("MQTT set PWM frequency: ") << data << endl;
+      setPwmFreqRGB(data.c_str());
+      return;
+    }
+
+    if ( topic.startsWith("calib") ) {
+      // Colour calibration per batch, see parseCalib
+      // Not persisted, use the config page for that
+
+      Serial << F("MQTT set calibration: ") << data << endl;
+      setCalibRGB(data.c_str());
+      return;
+    }
+
+    if ( topic.startsWith("timelineSeek") ) {
+      // Play position of the timeline in ms
+
+      if ( data.length() == 0 )
+        return;
+
+      uint32_t v = strtoul(data.c_str(), NULL, 10);
+      Serial << F("MQTT seek timeline: ") << v << endl;
+      seekTimelineRGB(v);
+      return;
+    }
+
+    if ( topic.startsWith("timeline") ) {
+      // Path of a timeline file on LittleFS, played right away
+      // Not persisted, use the config page for that
+
+      if ( data.length() == 0 )
+        return;
+
+      Serial << F("MQTT set timeline: ") << data << endl;
+      setTimelineRGB(data.c_str());
+      return;
+    }
+
+    if ( topic.startsWith("topology") ) {
+      // Number of densely packed strips or addr:r/g/b per strip
+      // Not persisted, use the config page for that
+
+      if ( data.length() == 0 )
+        return;
+
+      Serial << F("MQTT set new topology: ") << data << endl;
+      if ( isDigit( data[0] ) && data.indexOf(':') < 0 )
+        setTopologyRGB(strtoul(data.c_str(), NULL, 10), "");
+      else
+        setTopologyRGB(0, data.c_str());
+      return;
+    }
+
     if ( topic.startsWith("beep") ) {
 
       if ( data.length() == 0 )
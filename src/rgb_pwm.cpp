@@ -14,9 +14,7 @@ Persist in EEPROM
     walks through each colour on each strip in order
   
 ToDo:
-  make delay non blocking
   add Serial1 for commands from external
-  add pause after end of fade
 **********************************************************************/
 
 #define _GNU_SOURCE
@@ -26,20 +24,25 @@ ToDo:
 
 #include "global.h"
 #include "rgb_pwm.h"
+#include "timeline.h"
 
 //#include <TwiMap.h>
 //#include <I2cMaster.h>
 #include <brzo_i2c.h>
+#include <Ticker.h>
 
 // #include <digitalWriteFast.h>  // currently not supported by Arduino Leonardo
 
 const bool stubPCA = true;
 
-// 15 strips in prod
-// 5 in test
-const uint8_t MAX_STRIPS = 5;
+// Capacity. The strips actually in use (15 in prod, 5 in test) and
+// their wiring are configured at runtime, see setTopologyRGB.
+const uint8_t MAX_STRIPS = 48;
+static_assert(timeline::TIMELINE_MAX_STRIPS == MAX_STRIPS, "timeline and panel disagree on strips");
 
-const uint8_t PWM_OE_PIN = 9;
+// /OE of all PCAs, pin 9 of the ribbon cable, 100k pull-up on each
+// PWM board keeps them dark until driven. D5 on the D1 mini.
+const uint8_t PWM_OE_PIN = 14;
 
 //          SDA    SCL
 // NodeMCU   4      5
@@ -48,7 +51,11 @@ const uint8_t PWM_OE_PIN = 9;
 const uint8_t IIC_DTA = 4;
 const uint8_t IIC_CLK = 5;
 const uint16_t IIC_STRETCH = 1000; // time in us to allow stretch from a slave
-const uint16_t IIC_FREQ = 100;     // SCL frequency in kHz
+
+// SCL frequency in kHz. Starts at 100kHz, raised by qualifyBus up to
+// the configured maximum. PCA9685 supports Fm+ (1MHz).
+const uint16_t iicFreqSteps[IIC_FREQ_STEPS] = {100, 200, 400, 600, 800, 1000};
+uint16_t iicFreq = 100;
 
 const uint8_t BUZZER = 7;     // Pull active Buzzer to low
 const uint8_t BUZZER_ON = 0;  // Pull to ground to turn buzzer on
@@ -64,13 +71,33 @@ const uint8_t BUZZER_OFF = 1; //
 
 // Address is 1 A5 A4 A3 A2 A1 A0 R/!W
 // So if A0-A5 == 0, 1st address is 0x80
+// brzo takes the 7 bit address, so chips are 0x40, 0x41, 0x42, ...
 const uint8_t PCA_BASE_ADDRESS = (0x80 >> 1);
 const uint8_t PCA_ALLCALL_ADDRESS = (0xE0 >> 1);
 
 // Every PCA has 16 separate PWM lines.
 // Every strip attached requires 3 lines.
-// That's a max of 5 strips per PCA plus leaves 1 line free.
-const uint8_t PCA_LAST_ADDRESS = (PCA_BASE_ADDRESS + (((MAX_STRIPS * 3) / 16) * 2));
+// Channels are packed densely, so a strip may span two PCAs.
+// A sparse topology may put as little as one strip on a PCA.
+// PCA_MAX_CHIPS sizes the per PCA buffers (shadow, plan, bus queue and
+// prepared frame, about 300 bytes per PCA), so it is kept to what a
+// panel needs: 15 strips one per PCA, or MAX_STRIPS packed densely.
+const uint8_t PCA_CHANNELS = 16;
+const uint8_t PCA_MAX_CHIPS = 16;
+const uint8_t PCA_UNUSED = 0xFF; // Channel not fed by any strip
+
+// OFF time of a dark channel: the full OFF bit, bit 4 of LEDn_OFF_H.
+// ON and OFF must never be programmed to the same value, which a duty
+// of 0 at any phase would do.
+const uint16_t PCA_FULL_OFF = 0x1000;
+
+static_assert(PCA_MAX_CHIPS <= 64, "PCA bit masks too small");
+
+// Cost model for LEDn register writes in byte times on the bus.
+// A transaction costs START, address, register pointer and STOP plus
+// the setup of a brzo transaction. Each channel costs 4 bytes.
+const uint8_t PCA_TRANSACTION_COST = 5;
+const uint8_t PCA_CHANNEL_COST = 4;
 
 // Streaming c++ like output
 // http://playground.arduino.cc/Main/StreamingOutput
@@ -94,7 +121,7 @@ const uint8_t PCA_LAST_ADDRESS = (PCA_BASE_ADDRESS + (((MAX_STRIPS * 3) / 16) *
 //#include <EEPROMAnything.h>
 #include <EEPROM.h>
 
-static uint16_t EEPROM_ADDR_BASE = 1024;                         // Template
+static uint16_t EEPROM_ADDR_BASE = 2048;                         // Behind the IotWebConf config (~1.5k)
 static uint16_t EEPROM_ADDR_CYCLEMODE = EEPROM_ADDR_BASE + 0;    // cycleMode
 static uint16_t EEPROM_ADDR_SPEED = EEPROM_ADDR_BASE + 2;        // stepDelay
 static uint16_t EEPROM_ADDR_BRIGHT = EEPROM_ADDR_BASE + 4;       // pwm_oe
@@ -103,6 +130,7 @@ static uint16_t EEPROM_ADDR_DOBEEP = EEPROM_ADDR_BASE + 8;       // Beep on comm
 static uint16_t EEPROM_ADDR_SPEED_UNI = EEPROM_ADDR_BASE + 10;   //
 static uint16_t EEPROM_ADDR_SPEED_CLOUD = EEPROM_ADDR_BASE + 12; //
 static uint16_t EEPROM_ADDR_SPEED_WAVE = EEPROM_ADDR_BASE + 14;  //
+static uint16_t EEPROM_ADDR_HUE_SPEED = EEPROM_ADDR_BASE + 16;   // hueSpeed
 static uint16_t EEPROM_SIZE = 32;
 
 #endif
@@ -151,16 +179,44 @@ uint16_t _ABORT_LINE;
   }
 #endif
 
+// Effect state as struct of arrays, one entry per strip
+// h is a wrapping 16bit angle, s and v are Q16 fractions (see hsv2pcaFixed)
+typedef struct
+{
+  uint16_t h[MAX_STRIPS];
+  uint16_t s[MAX_STRIPS];
+  uint16_t v[MAX_STRIPS];
+} hsv_soa_st;
+
+// Per step delta of hsv_soa_st. Hue wraps, so a signed delta always
+// moves the short way round the colour wheel.
 typedef struct
 {
-  double h, s, v;
-} hsv_st;
+  int16_t h[MAX_STRIPS];
+  int16_t s[MAX_STRIPS];
+  int16_t v[MAX_STRIPS];
+} hsv_delta_soa_st;
 
 typedef struct
 {
   uint16_t r, g, b;
 } rgb_st;
 
+// OKLab colour per strip as struct of arrays, Q15 (see rgb2oklab)
+typedef struct
+{
+  int16_t L[MAX_STRIPS];
+  int16_t a[MAX_STRIPS];
+  int16_t b[MAX_STRIPS];
+} lab_soa_st;
+
+// Colour space a fade interpolates in
+enum fade_t
+{
+  fadeHsv = 0,   // Hue, cheap, muddy half way between distant hues
+  fadeOklab = 1  // Perceptual, even lightness and speed
+};
+
 // ### union or just an additional array pointer???
 typedef union
 {
@@ -168,48 +224,333 @@ typedef union
   uint16_t a[MAX_STRIPS * 3];
 } pca_rgb_ut;
 
-hsv_st strip[MAX_STRIPS];    // Every strip's color
-hsv_st hsvDelta[MAX_STRIPS]; // Delta color for cycling
-uint16_t countMaxSteps = 0;  // Steps for a cycle periode
-uint16_t countSteps = 0;     // Step within cycle
-
+hsv_soa_st strip;           // Every strip's color
+hsv_delta_soa_st hsvDelta;  // Delta color for cycling
+uint16_t cloudHoldMs = 1000; // Pause after each cloud fade
+uint16_t cloudFadeMs = 1000; // Duration of each cloud fade
+uint32_t cloudFadeUs = 0;    // Time into the running fade
+uint32_t cloudFadeLenUs = 1; // Duration of the running fade
+uint8_t cloudFade = fadeHsv; // fade_t of the next cloud fade
+
+// Frame as effects draw it, 16 bit per colour, FRAME_MAX is full on.
+// ditherFrame turns it into the 12 bit PCA values of pca_out.
+const uint16_t FRAME_MAX = 65535;
 pca_rgb_ut pca_rgb;
+pca_rgb_ut pca_out;
 
-// enum for all valid program cycle modes
-enum cycleMode_t
-{
-  noChange = 0, // First element. Stop running program, keep last HLS
+// Set by everything that changes pca_rgb or how the output stage turns
+// it into pca_out. A frame without it is idle and skipped, see loopRgb.
+bool frameDirty = true;
 
-  allOff = 1,
-  allOn = 2,
+// Temporal dithering. Channels below ditherBelow (12 bit) show their
+// 16 bit value on average over a few frames.
+uint16_t ditherBelow = 0;              // 0: off
+uint8_t ditherErr[MAX_STRIPS * 3];     // Fraction carried to the next frame
+uint8_t ditherChannels = 0;            // Channels dithered in the last frame
+
+// Output curve applied by ditherFrame, see Output curves
+const uint16_t *curveLut = nullptr;    // PROGMEM, nullptr: linear
+
+// Colour calibration of a batch of strips, applied by ditherFrame after
+// the output curve. out = m x in, clipped to max. Diagonal matrices
+// need one multiply per channel, identity none.
+const uint8_t CALIB_BATCHES = 4;
+
+enum calib_t
+{
+  calibIdentity = 0,
+  calibDiagonal = 1,
+  calibMatrix = 2
+};
 
-  red = 3, // all strips same color
-  green = 4,
-  blue = 5, // all strips same color
+typedef struct
+{
+  int16_t m[9];    // Q12, 4096 is 1.0, row major, rows are R, G, B out
+  uint16_t max[3]; // 16 bit duty limit per channel
+  uint8_t kind;    // calib_t
+} calib_st;
+
+calib_st calib[CALIB_BATCHES];
+
+// Power limiter, see limitPower. dutySum follows pca_out per colour and
+// is updated from the channels ditherFrame changes.
+uint16_t powerBudgetMa = 0;            // 0: off
+uint16_t channelMa[3] = {250, 250, 250}; // Per strip and colour at full duty
+uint32_t dutySum[3];                   // Sum of the 12 bit pca_out values
+bool dutySumValid = false;             // false: ditherFrame sums from scratch
+uint16_t powerLastMa = 0;              // Estimate of the last frame before limiting
+
+// Shadow copy of the LEDn registers as last written to a PCA
+typedef struct
+{
+  uint16_t on[PCA_CHANNELS];
+  uint16_t off[PCA_CHANNELS];
+  bool valid; // false: chip content unknown, rewrite all channels
+} pca_shadow_st;
 
-  uniform = 6, // all strips same color, cycle through HLS
-  cloud = 7,
-  wave = 8,
+pca_shadow_st pcaShadow[PCA_MAX_CHIPS];
 
-  debug = 9,
+// Power state of a PCA, see updatePcaPower. A PCA whose channels are
+// all dark goes to SLEEP, its oscillator stops. With all PCAs asleep
+// /OE is held off as well.
+enum pca_power_t
+{
+  pcaAwake = 0,
+  pcaAsleep = 1,
+  pcaWaking = 2 // SLEEP cleared, RESTART after PCA_WAKE_US
+};
 
-  illegal = 10 // End element. Maybe we cycle through programs in the future.
+typedef struct
+{
+  uint8_t state;   // pca_power_t
+  bool blank;      // All channels 0 in the last frame
+  uint32_t since;  // ms the PCA went blank, us it started waking
+} pca_power_st;
+
+const uint32_t PCA_SLEEP_AFTER_MS = 1000; // Blank this long before SLEEP
+const uint16_t PCA_WAKE_US = 500;         // Oscillator start up
+pca_power_st pcaPower[PCA_MAX_CHIPS];
+uint8_t pcaSleeping = 0;                  // PCAs asleep or waking
+bool oeGated = false;                     // /OE held off, all PCAs asleep
+
+// PWM frequency, PRE_SCALE = round(25MHz / (4096 x Hz)) - 1. The
+// register only takes writes while the PCA sleeps, see setPwmFreqRGB.
+const uint32_t PCA_OSC_HZ = 25000000;
+const uint16_t PWM_FREQ_MIN = 24;         // PRE_SCALE 253
+const uint16_t PWM_FREQ_MAX = 1526;       // PRE_SCALE 3, the lowest allowed
+uint8_t pcaPrescale = 30;                 // Power on default, about 200Hz
+
+// Presets by name, Hz
+typedef struct
+{
+  const char *name; // PROGMEM
+  uint16_t hz;
+} pwm_preset_st;
+
+const char pwmPresetDefault[] PROGMEM = "default";
+const char pwmPresetCamera[] PROGMEM = "camera";
+const char pwmPresetHighspeed[] PROGMEM = "highspeed";
+
+const pwm_preset_st pwmPresets[] PROGMEM = {
+    {pwmPresetDefault, 200},    // Power on default of the PCA, bands on phone cameras
+    {pwmPresetCamera, 1200},    // Prescale 4, 1221Hz nominal (the oscillator is +-10%),
+                                // a 1/120s exposure sees ~10 periods, little banding
+    {pwmPresetHighspeed, 1526}, // Highest possible, a 1/1000s exposure sees 1.5 periods
 };
+const uint8_t PWM_PRESET_COUNT = sizeof(pwmPresets) / sizeof(pwmPresets[0]);
+
+// Wiring of a strip: IIC address and channel of its R, G and B line
+typedef struct
+{
+  uint8_t addr[3];
+  uint8_t channel[3];
+  uint8_t batch; // Calibration batch, see setCalibRGB
+} strip_map_st;
+
+// Precomputed write plan of a PCA. Rebuilt when the topology changes.
+typedef struct
+{
+  uint8_t addr;              // 7 bit IIC address
+  uint8_t count;             // Channels 0..count-1 are written
+  uint8_t src[PCA_CHANNELS]; // Index into pca_out.a feeding the channel or PCA_UNUSED
+  uint16_t phase[PCA_CHANNELS]; // ON time of the channel if staggered, see buildPanelPlan
+} pca_plan_st;
+
+uint8_t numStrips = 5;
+strip_map_st stripMap[MAX_STRIPS];
+
+uint8_t pcaChips = 0;
+pca_plan_st pcaPlan[PCA_MAX_CHIPS];
+
+// Broadcast plan for uniform frames. Usable if every channel carries
+// the same colour component (0: R, 1: G, 2: B) on all PCAs using it.
+// ALL_CALL writes unmapped channels too, so nothing is broadcast
+// unless all channels of every PCA are mapped (full).
+typedef struct
+{
+  bool usable;
+  bool full;
+  uint8_t count;              // Channels 0..count-1 are written
+  uint8_t comp[PCA_CHANNELS]; // Colour component of the channel or PCA_UNUSED
+} pca_broadcast_st;
+
+pca_broadcast_st pcaBroadcast;
+bool pcaBusExclusive = false; // No PCA on the bus outside the plan, see initPanel
+
+bool panelInitialized = false;
+
+// Configuration, see iotWebConf.cpp
+char rgbStrips[RGB_STRIPS_STR_LEN] = "5";
+char rgbTopology[RGB_TOPOLOGY_STR_LEN] = "";
+char rgbIicMaxFreq[RGB_IIC_MAX_FREQ_STR_LEN] = "1000";
+char rgbCurve[RGB_CURVE_STR_LEN] = "linear";
+char rgbCalib[RGB_CALIB_STR_LEN] = "1000,250,250";
+char rgbBrightnessRamp[RGB_BRIGHTNESS_RAMP_STR_LEN] = "500";
+char rgbPowerBudget[RGB_POWER_BUDGET_STR_LEN] = "0";
+char rgbChannelCurrent[RGB_CHANNEL_CURRENT_STR_LEN] = "250,250,250";
+char rgbPwmFreq[RGB_PWM_FREQ_STR_LEN] = "camera";
+
+rgb_telemetry_st rgbTelemetry;
+
+uint32_t iicTransactions = 0; // LEDn write transactions since boot
+uint32_t iicBytes = 0;        // LEDn bytes written since boot
+
+// Synchronized output. All LEDn writes of a frame are queued and sent
+// in a single bus transaction using repeated starts. MODE2.OCH is 0,
+// so every PCA latches its new outputs on the one STOP at the end.
+bool syncOutput = false;
+
+// Staggered phases. Each channel switches on at its own phase of the
+// PWM period instead of all at 0, which spreads the current steps.
+bool phaseStagger = true;
+
+typedef struct
+{
+  uint8_t addr; // 7 bit IIC address
+  uint16_t pos; // Start in iicQueue
+  uint8_t len;  // Bytes incl. register pointer
+} iic_segment_st;
+
+const uint16_t IIC_MAX_SEGMENTS = PCA_MAX_CHIPS * 6; // Runs per PCA are at most 6 with gaps of 1 bridged
+
+uint8_t iicQueue[PCA_MAX_CHIPS * (1 + PCA_CHANNELS * 4)];
+uint16_t iicQueueLen = 0;
+iic_segment_st iicSegments[IIC_MAX_SEGMENTS];
+uint16_t iicSegmentCount = 0;
+bool iicQueueFull = false;     // A write of this frame did not fit, see pca_queue
+uint32_t iicFramesDropped = 0; // Frames dropped because the queue was full
+
+// Output skew: time between the first and the last PCA latching a frame.
+// A frame sent in one transaction (sync or timed output) latches on its
+// one STOP on all PCAs, its skew is 0. How long that transaction takes
+// is kept apart in rgbTelemetry.txLastUs / txMaxUs, see recordTx.
+uint32_t skewFrames = 0;
+uint32_t skewLastUs = 0;
+uint32_t skewMaxUs = 0;
+uint32_t skewSumUs = 0;
+
+// Timed output. The loop only prepares frames, a Ticker puts them on
+// the bus at a fixed rate, so the output cadence does not depend on
+// how long a frame takes to render. Ticker is an os_timer, its
+// callbacks run in the system context between two loop() calls: they
+// never cut into a bus transaction of the loop, but a loop stalled by
+// WiFi, web or MQTT delays the output just the same. Off by default.
+bool timedOutput = false;
+Ticker outputTicker;
+
+// Prepared frame. updatePanel stores a frame as it goes on the bus:
+// address, length and bytes of each segment back to back. outputTick
+// sends it on the next tick. One frame only, rendering further ahead
+// would not help: the Ticker cannot run while the loop stalls, so
+// queued frames would only add latency.
+// outReady is only set by the loop, only cleared by the Ticker.
+const uint16_t OUT_FRAME_MAX_BYTES = sizeof(iicQueue) + IIC_MAX_SEGMENTS * 2;
+
+uint8_t outFrame[OUT_FRAME_MAX_BYTES];
+uint16_t outFrameLen = 0;
+uint8_t outFrameTouched = 0; // PCAs written to by the frame
+uint64_t outFrameChips = 0;  // Bit c: the frame writes to pcaPlan[c]
+uint8_t outFrameOe = 0;      // /OE on time the frame goes out with
+volatile bool outReady = false;
+
+volatile bool outFailed = false; // bus error on output, PCA state unknown
+
+// Idle panel. After IDLE_AFTER_FRAMES idle frames in a row the loop
+// only looks for changes every IDLE_INTERVAL_US. Until then an empty
+// frame is pushed into outFrame to keep the cadence, after that none,
+// the output ticks find outReady clear on purpose and do not count an
+// underrun. All PCAs are rewritten every PANEL_REFRESH_MS in case a
+// glitch changed a register.
+const uint8_t IDLE_AFTER_FRAMES = 8;
+const uint32_t IDLE_INTERVAL_US = 100000;
+const uint32_t PANEL_REFRESH_MS = 5000;
+volatile uint8_t idleFrames = 0; // Idle frames in a row, up to IDLE_AFTER_FRAMES
+uint32_t idleNextUs = 0;
+uint32_t idleSkipped = 0;        // Frames not sent because nothing changed
+uint32_t panelRefreshMs = 0;
+
+// Histogram of the interval between two output frames for the p99.
+// Bins are 1/16 of the frame interval wide, the last one catches all
+// longer intervals.
+const uint8_t OUT_HIST_BINS = 48;
+uint16_t outHist[OUT_HIST_BINS];
+uint32_t outHistBinUs = 1;
+uint32_t outLastUs = 0;
+uint32_t outIntervalUs = 10000; // Ticker period, full ms
 
 bool newCommandAvail = false;
 char newCommand = ' ';
 
-// https://stackoverflow.com/questions/4437527/why-do-we-use-volatile-keyword-in-c
-// why here?
-volatile cycleMode_t cycleMode;
-volatile cycleMode_t cycleModeOld;
+uint8_t cycleMode;    // Index into effects[]
+uint8_t cycleModeOld; // Effect to return to from hold
 
 void (*init_func)(void);
-void (*step_func)(void);
+void (*step_func)(uint32_t dtUs);
 //void (*speed_func)(int8_t);
 bool newCycleModeSelected;
-uint32_t lastStepTS = 0;
 uint16_t stepDelay = 10; // ### uint16_t??? maybe uit8_t is sufficient
+bool effectLog = true;   // Effects print debug output, muted by effectPerfTest
+
+// Frame scheduler. Frames are due every frameIntervalUs on a fixed
+// cadence. Set from stepDelay (ms) or from a target fps.
+uint32_t frameIntervalUs = 10000;
+uint32_t nextFrameUs = 0;
+uint32_t framesSkipped = 0; // frames dropped because we fell behind
+bool fpsSet = false;        // set/fps was used, effects keep that rate
+
+// Time based animation. Step functions get the time in us since the
+// last frame and advance by speed x time, so the look of an effect
+// does not depend on the frame rate. The hue runs as a Q16.16 phase,
+// the upper 16 bits are the hue, the lower ones keep the fraction.
+const uint16_t HUE_SPEED_MAX = 6000; // 600 cycles/min, keeps hueRateQ16 within 32 bits
+uint16_t hueSpeed = 60;              // Hue cycles per minute x10
+bool speedSet = false;               // set/speed was used, effects keep that speed
+uint32_t hueRateQ16 = 0;             // Phase increment per us, Q16.16
+uint32_t wavePhase = 0;              // Each effect keeps its own phase, they may
+uint32_t uniformPhase = 0;           // run side by side on layers
+
+uint32_t lastStepUs = 0; // Time of the last step without timed output
+uint32_t renderTick = 0; // Output tick the last rendered frame goes out on
+
+// Layer stack. Layer 0 runs the cycle mode on all strips, accent layers
+// on top run further effects on a range of strips. Each layer keeps its
+// own frame, effects draw on it as if it was pca_rgb. Only animated
+// layers are stepped and only the strips a changed layer covers are
+// composited again, a static base under an accent costs next to nothing.
+// Effects keep their state in globals, so an effect runs on one layer
+// at most.
+const uint8_t MAX_LAYERS = 4;
+
+enum blend_t
+{
+  blendNormal = 0,
+  blendAdd = 1,
+  blendMultiply = 2,
+  blendMax = 3
+};
+
+typedef struct
+{
+  void (*init)(void);
+  void (*step)(uint32_t dtUs);
+  uint8_t effect;  // Index into effects[]
+  uint8_t first;   // First strip
+  uint8_t count;   // Strips, clipped to numStrips
+  uint8_t opacity; // 0: transparent, 255: opaque
+  uint8_t blend;   // blend_t
+  bool animated;   // Stepped each frame, static layers only run init
+  bool needInit;
+  rgb_st frame[MAX_STRIPS];
+} layer_st;
+
+static_assert(MAX_STRIPS <= 64, "layer dirty mask too small");
+
+// Layer 0 is always there and covers all strips
+layer_st layers[MAX_LAYERS] = {{nullptr, nullptr, 0, 0, MAX_STRIPS, 255, blendNormal, false, false, {}}};
+uint8_t numLayers = 1;
+rgb_st layerOut[MAX_STRIPS];  // Composited frame
+uint64_t layersDirty = 0;     // Strips to composite on the next frame
+uint32_t layerStrips = 0;     // Strips composited since boot
 
 //TwiMaster iic(true);
 
@@ -218,6 +559,28 @@ uint8_t deb_color = 0;
 
 uint8_t pwm_oe = 0; // 0 -> full On, 255 -> full Off
 
+// Global brightness, a new pwm_oe ramps the level over
+// brightnessRampMs. Two paths drive it:
+// - /OE: hardware PWM of the output enable, dims all PCAs at once
+//   without any bus traffic. 8 bit, used from OE_MIN_LEVEL up.
+// - Frame scale: below OE_MIN_LEVEL /OE stays there and ditherFrame
+//   multiplies the frame by the rest in 16 bit, dithered like any
+//   other low value.
+// Both take effect with the next frame: /OE is set when that frame is
+// sent, so the PCAs never show a frame with the /OE of another one.
+const uint16_t OE_PWM_RANGE = 255;
+const uint16_t OE_PWM_FREQ = 20000;    // Hz, well above the PCA PWM, no beating
+const uint8_t OE_MIN = 64;             // Lowest /OE on time
+const uint16_t OE_MIN_LEVEL = OE_MIN * 257;
+uint16_t brightnessRampMs = 500;
+uint16_t brightnessFrom = 65535;       // Level at the start of the ramp, Q16
+uint16_t brightnessTo = 65535;         // Level at the end of the ramp, Q16
+uint16_t brightnessLevel = 65535;      // Current level, Q16
+uint32_t brightnessStartMs = 0;
+uint8_t oeLevel = 0;                   // /OE on time of the next frame, OE_PWM_RANGE: full on
+uint8_t oeOut = 0;                     // /OE on time of the frame on the PCAs
+uint32_t frameScale = 65536;           // Q16, applied by ditherFrame
+
 uint32_t loopCount = 0;
 
 uint16_t seedValue = 0;
@@ -233,82 +596,227 @@ uint8_t doBeep = 1; // Beep if true on various occasions
 **********************************************************************/
 bool pca_init(uint8_t addr);
 int freeRam(void);
-void hsv2pca(double h, double s, double v, uint16_t *_r, uint16_t *_g, uint16_t *_b);
-void pca_rgb_update(uint16_t *arr, uint8_t chip, uint8_t count);
+void hsv2pcaFixed(uint16_t h, uint16_t s, uint16_t v, uint16_t *_r, uint16_t *_g, uint16_t *_b);
+void hsv2rgbFixed(uint16_t h, uint16_t s, uint16_t v, uint16_t *_r, uint16_t *_g, uint16_t *_b);
+void rgb2oklab(uint16_t r, uint16_t g, uint16_t b, int16_t *_L, int16_t *_a, int16_t *_b);
+void oklab2pca(int16_t L, int16_t a, int16_t b, uint16_t *_r, uint16_t *_g, uint16_t *_b);
+void hsv2pcaDouble(double h, double s, double v, uint16_t *_r, uint16_t *_g, uint16_t *_b);
+uint16_t pcaOffTime(uint16_t duty, uint16_t on);
+void pca_rgb_update(uint16_t *arr, const uint16_t *phase, uint8_t chip, uint8_t count, pca_shadow_st *shadow);
+bool pca_queue(uint8_t addr, const uint8_t *buff, uint8_t len);
+uint8_t pca_send_segments(const uint8_t *queue, const iic_segment_st *segments, uint16_t count);
+uint8_t pca_send_frame(const uint8_t *frame, uint16_t len);
+bool parseTopology(const char *, strip_map_st *, uint8_t *);
+bool parseCalib(const char *, calib_st *);
+bool topologyMap(uint8_t, const char *, strip_map_st *, uint8_t *);
+bool buildPanelPlan(const strip_map_st *, uint8_t, bool apply = true);
+bool calibFromString(const char *, calib_st *);
+uint16_t pwmFreqHz(const char *);
+bool parseChannelCurrent(const char *, uint16_t *);
 void initPanel(void);
+uint16_t qualifyBus(uint16_t maxFreq);
+uint8_t pca_verify(uint8_t addr, uint16_t freq);
 void updatePanel(void);
+void updatePcaPower(bool frame);
+bool pca_write_regs(uint8_t addr, uint8_t reg, const uint8_t *data, uint8_t len);
+bool pca_probe(uint8_t addr);
+void pca_set_prescale(void);
+void ditherFrame(void);
+void limitPower(void);
+void setBrightnessLevel(uint16_t level);
+void applyOe(uint8_t oe);
+void rampBrightness(void);
+bool updatePanelBroadcast(void);
+bool pca_write_all_led(uint16_t on, uint16_t off);
+bool pca_flush_queue(void);
 void cloud_ReInit(void);
-void cloud_Step(void);
+void cloud_Step(uint32_t dtUs);
 void cloud_Init(void);
-void uniform_Step(void);
+void uniform_Step(uint32_t dtUs);
 void uniform_Init(void);
-void wave_Step(void);
+void wave_Step(uint32_t dtUs);
 void wave_Init(void);
-void debug_Step(void);
+void debug_Step(uint32_t dtUs);
 void debug_Init(void);
+void timeline_Step(uint32_t dtUs);
+void timeline_Init(void);
 void blue_Init(void);
 void green_Init(void);
-void red_Step(void);
+void red_Step(uint32_t dtUs);
 void red_Init(void);
 void uni_Init(uint16_t r, uint16_t g, uint16_t b);
-void allOn_Step(void);
+void allOn_Step(uint32_t dtUs);
 void allOn_Init(void);
-void allOff_Step(void);
+void allOff_Step(uint32_t dtUs);
 void allOff_Init(void);
-void dummy_Step(void);
+void dummy_Step(uint32_t dtUs);
 void dummy_Init(void);
 void dump_structures(void);
 uint8_t processSerialInput(char);
-uint8_t setCycleMode(cycleMode_t cm);
+uint8_t setCycleMode(uint8_t cm);
+void buildEffectHash(void);
 void initEEPROM(uint8_t, uint16_t, uint16_t);
 void dumpEEPROM(uint16_t, uint16_t);
+bool frameDue(void);
+void restartFrames(void);
+uint32_t frameDt(void);
+void setHueSpeed(uint16_t);
+void restartOutput(void);
+void outputTick(void);
+void outFramePush(void);
+void outFrameDrop(void);
+void recordSkew(uint32_t us);
+void recordTx(uint32_t us);
+void renderLayers(bool init, uint32_t dtUs);
+void removeLayer(uint8_t k);
 void loop();
 void setup();
 void beep(uint16_t firstArg, ...);
 void serialPerfTest(void);
+void hsvPerfTest(void);
+void effectPerfTest(void);
 void dumpHelp(void);
 //*********************************************************************
 
-#if 0 // Arrays for Init, Step, Name of cycleMode
-PROGMEM const char *cycleName[] =
-{
-  "noChange",
-  "allOff",
-  "allOn",
-  "red",
-  "green",
-  "blue",
-  "uniform",
-  "cloud",
-  "wave"
+/**********************************************************************
+  Effect registry
+  
+  One entry per cycle mode. Serial help, MQTT and the web page all
+  enumerate this table, its index is the cycle mode. A new effect only
+  needs an entry here.
+  Entries live in flash, copy them with getEffectRGB before use.
+  Costs are estimates of the step function on a 80MHz ESP8266, the
+  perf test 'p' measures them.
+**********************************************************************/
+const char effectNoChange[] PROGMEM = "noChange";
+const char effectAllOff[] PROGMEM = "allOff";
+const char effectAllOn[] PROGMEM = "allOn";
+const char effectRed[] PROGMEM = "red";
+const char effectGreen[] PROGMEM = "green";
+const char effectBlue[] PROGMEM = "blue";
+const char effectUniform[] PROGMEM = "uniform";
+const char effectCloud[] PROGMEM = "cloud";
+const char effectWave[] PROGMEM = "wave";
+const char effectDebug[] PROGMEM = "debug";
+const char effectTimeline[] PROGMEM = "timeline";
+
+const char paramCloudHold[] PROGMEM = "cloudHold";
+const char paramCloudDuration[] PROGMEM = "cloudDuration";
+const char paramCloudFade[] PROGMEM = "cloudFade";
+
+const effect_param_st cloudParams[] PROGMEM = {
+    // name, min, max, setter
+    {paramCloudHold, 0, 60000, &setCloudHoldRGB},
+    {paramCloudDuration, 1, 60000, &setCloudDurationRGB},
+    {paramCloudFade, fadeHsv, fadeOklab, &setCloudFadeRGB},
 };
 
-PROGMEM void (*cycleInitFuncs[])(void) =
-{
-  &dummy_Init,
-  &allOff_Init,
-  &allOn_Init,
-  &red_Init,
-  &green_Init,
-  &blue_Init,
-  &uniform_Init,
-  &cloud_Init,
-  &wave_Init
+const effect_st effects[] PROGMEM = {
+    // name, key, init, step, stepDelay, speed, params, paramCount, cost us base, per strip
+    {effectNoChange, 0, &dummy_Init, &dummy_Step, 0, 0, nullptr, 0, 0, 0},
+    {effectAllOff, '0', &allOff_Init, &allOff_Step, 0, 0, nullptr, 0, 0, 0},
+    {effectAllOn, '1', &allOn_Init, &allOn_Step, 0, 0, nullptr, 0, 0, 0},
+    {effectRed, '2', &red_Init, &dummy_Step, 0, 0, nullptr, 0, 0, 0},
+    {effectGreen, '3', &green_Init, &dummy_Step, 0, 0, nullptr, 0, 0, 0},
+    {effectBlue, '4', &blue_Init, &dummy_Step, 0, 0, nullptr, 0, 0, 0},
+    {effectUniform, '5', &uniform_Init, &uniform_Step, 10, 60, nullptr, 0, 3, 1},
+    {effectCloud, '6', &cloud_Init, &cloud_Step, 10, 0, cloudParams, 3, 1, 3},
+    {effectWave, '7', &wave_Init, &wave_Step, 10, 60, nullptr, 0, 1, 3},
+    {effectDebug, 'd', &debug_Init, &debug_Step, 500, 0, nullptr, 0, 1, 0},
+    {effectTimeline, 't', &timeline_Init, &timeline_Step, 10, 0, nullptr, 0, 4, 1},
 };
 
-PROGMEM void (*cycleStepFuncs[])(void) =
-{
-  &dummy_Step,
-  &allOff_Step,
-  &allOn_Step,
-  &dummy_Step,
-  &dummy_Step,
-  &dummy_Step,
-  &uniform_Step,
-  &cloud_Step,
-  &wave_Step
+const uint8_t EFFECT_COUNT = sizeof(effects) / sizeof(effects[0]);
+const uint8_t EFFECT_HOLD = 0; // noChange, keeps the last frame
+
+// Open addressing hash of the effect names for effectIndexRGB.
+// Holds index + 1, 0 marks an empty bucket.
+const uint8_t EFFECT_HASH_SIZE = 32; // Power of 2, less than half full
+uint8_t effectHash[EFFECT_HASH_SIZE];
+
+static_assert(EFFECT_COUNT < EFFECT_HASH_SIZE / 2, "effectHash too small");
+
+/**********************************************************************
+  Output curves
+  
+  PWM duty is linear in light, perceived brightness is not, so a linear
+  frame looks washed out and mid level fades look uneven. A curve maps
+  the 16 bit frame to the 16 bit duty right before dithering.
+  The LUTs are computed by the compiler and live in flash. 1024 entries
+  indexed by the upper 10 bits of the frame, one read per channel and
+  frame. setCurveRGB selects one by name at runtime.
+**********************************************************************/
+const uint16_t CURVE_LUT_SIZE = 1024;
+
+enum curve_t
+{
+  curveLinear = 0,
+  curveGamma22 = 1, // x^2.2
+  curveGamma28 = 2, // x^2.8, common for LEDs
+  curveCie = 3      // CIE 1931 lightness L*
 };
-#endif
+
+// x^(1/5) for x in 0..1, Newton's method from above
+constexpr double curveRoot5(double x)
+{
+  double r = 1;
+
+  if (x <= 0)
+    return 0;
+  for (uint8_t i = 0; i < 40; i++)
+    r = (4 * r + x / (r * r * r * r)) / 5;
+  return r;
+}
+
+// Duty 0..1 for frame value x 0..1
+constexpr double curveValue(uint8_t curve, double x)
+{
+  switch (curve)
+  {
+  case curveGamma22:
+    return x * x * curveRoot5(x);
+  case curveGamma28:
+  {
+    double r = curveRoot5(x);
+    return x * x * r * r * r * r;
+  }
+  case curveCie:
+  {
+    double l = x * 100;
+    double f = (l + 16) / 116;
+    return (l > 8) ? f * f * f : l / 903.3;
+  }
+  case curveLinear:
+  default:
+    return x;
+  }
+}
+
+template <uint8_t CURVE>
+struct curve_lut_st
+{
+  uint16_t v[CURVE_LUT_SIZE];
+
+  constexpr curve_lut_st() : v()
+  {
+    for (uint16_t i = 0; i < CURVE_LUT_SIZE; i++)
+      v[i] = curveValue(CURVE, (double)i / (CURVE_LUT_SIZE - 1)) * 65535 + 0.5;
+  }
+};
+
+constexpr curve_lut_st<curveGamma22> gamma22Lut PROGMEM = curve_lut_st<curveGamma22>();
+constexpr curve_lut_st<curveGamma28> gamma28Lut PROGMEM = curve_lut_st<curveGamma28>();
+constexpr curve_lut_st<curveCie> cieLut PROGMEM = curve_lut_st<curveCie>();
+
+const char curveLinearName[] PROGMEM = "linear";
+const char curveGamma22Name[] PROGMEM = "gamma22";
+const char curveGamma28Name[] PROGMEM = "gamma28";
+const char curveCieName[] PROGMEM = "cie";
+
+// Indexed by curve_t, linear needs no LUT
+const char *const curveNames[] PROGMEM = {curveLinearName, curveGamma22Name, curveGamma28Name, curveCieName};
+const uint16_t *const curveLuts[] PROGMEM = {nullptr, gamma22Lut.v, gamma28Lut.v, cieLut.v};
+const uint8_t CURVE_COUNT = sizeof(curveNames) / sizeof(curveNames[0]);
 
 /**********************************************************************
   Arduino Setup
@@ -327,28 +835,40 @@ void setupRgb()
 
   //  pinMode(13, OUTPUT);
 
+  // Topology from configuration
+  Serial << F("Init Topology...") << endl;
+  if (!setTopologyRGB(atoi(rgbStrips), rgbTopology))
+  {
+    Serial << F("Falling back to 5 densely packed strips") << endl;
+    setTopologyRGB(5, "");
+  }
+
   // Init PCA
   Serial << F("Init Panel...") << endl;
+  if (!setPwmFreqRGB(rgbPwmFreq))
+    setPwmFreqRGB("default");
   initPanel();
 
+  // Find the fastest reliable bus speed
+  Serial << F("Qualify IIC bus...") << endl;
+  qualifyBus(atoi(rgbIicMaxFreq));
+
   // Init RGB Structures
   Serial << F("Init RGB Structures...") << endl;
-  for (uint8_t i = 0; i < MAX_STRIPS; i++)
-  {
-    pca_rgb.rgb[i].r = pca_rgb.rgb[i].g = pca_rgb.rgb[i].b = 0;
-    strip[i].h = strip[i].s = strip[i].v = 0;
-    hsvDelta[i].h = hsvDelta[i].s = hsvDelta[i].v = 0;
-  }
+  memset(&pca_rgb, 0, sizeof(pca_rgb));
+  memset(&strip, 0, sizeof(strip));
+  memset(&hsvDelta, 0, sizeof(hsvDelta));
 
 #if 1
-  init_func = &allOn_Init;
-  step_func = &allOn_Step;
-
-  cycleMode = cycleModeOld = allOn;
-  newCycleModeSelected = true;
   seedValue = 0;
   stepDelay = 10;
+  frameIntervalUs = stepDelay * 1000UL;
+  setHueSpeed(hueSpeed);
   pwm_oe = 0;
+
+  buildEffectHash();
+  setCycleMode(effectIndexRGB("allOn"));
+  cycleModeOld = cycleMode;
 #endif
 
 #if 0 // Init parameters from EEPROM
@@ -357,7 +877,7 @@ void setupRgb()
   //
 
 //  initEEPROM();
-  EEPROM.begin(EEPROM_SIZE);
+  EEPROM.begin(EEPROM_ADDR_BASE + EEPROM_SIZE);
   
   dumpEEPROM(EEPROM_ADDR_BASE, EEPROM_SIZE);
   
@@ -365,13 +885,13 @@ void setupRgb()
   { // Open block for local variable
 
     // Fetch cycleMode from EEPROM
-    cycleMode_t cm = (cycleMode_t) EEPROM.read(EEPROM_ADDR_CYCLEMODE);
+    uint8_t cm = EEPROM.read(EEPROM_ADDR_CYCLEMODE);
     Serial << F("cycleMode: ") << cm << ' ';
     // Initialize system
     if (! setCycleMode(cm))
     { // cycleMode read from EEPROM was not a valid one - e.g. uninitialized parameters
       // Initialize to allOn instead to see the system is working.
-      setCycleMode(allOn);
+      setCycleMode(effectIndexRGB("allOn"));
     }
   }
   
@@ -380,6 +900,17 @@ void setupRgb()
   ((uint8_t *)(&stepDelay))[1] = EEPROM.read(EEPROM_ADDR_SPEED + 1);
   Serial << F("stepDelay: ") << stepDelay << endl;
 
+  // Initialize hueSpeed with values from EEPROM, 0xFFFF: never set
+  uint16_t speed;
+  ((uint8_t *)(&speed))[0] = EEPROM.read(EEPROM_ADDR_HUE_SPEED);
+  ((uint8_t *)(&speed))[1] = EEPROM.read(EEPROM_ADDR_HUE_SPEED + 1);
+  if (speed != 0xFFFF)
+  {
+    setHueSpeed(speed);
+    speedSet = true;
+  }
+  Serial << F("hueSpeed: ") << hueSpeed << endl;
+
   // Initialize random number generator seed with values from EEPROM
   ((uint8_t *)(&seedValue))[0] = EEPROM.read(EEPROM_ADDR_SEED);
   ((uint8_t *)(&seedValue))[1] = EEPROM.read(EEPROM_ADDR_SEED + 1);
@@ -394,14 +925,22 @@ void setupRgb()
   // Initialize pwm_oe with values from EEPROM
   pwm_oe = EEPROM.read(EEPROM_ADDR_BRIGHT);
   Serial << F("pwm_oe: ") << pwm_oe << ".\n";
+  brightnessTo = (255 - pwm_oe) * 257;
+  brightnessFrom = brightnessTo;
   
   doBeep = EEPROM.read(EEPROM_ADDR_DOBEEP);
   Serial << F("doBeep: ") << doBeep << ".\n";
 
 #endif
 
-//  Serial << F("PWM /OE...\n");
-  //  analogWrite(PWM_OE_PIN, pwm_oe);
+  // /OE starts off, the first level switches it on
+  Serial << F("PWM /OE...\n");
+  pinMode(PWM_OE_PIN, OUTPUT);
+  analogWriteRange(OE_PWM_RANGE);
+  analogWriteFreq(OE_PWM_FREQ);
+  oeLevel = oeOut = 0;
+  analogWrite(PWM_OE_PIN, OE_PWM_RANGE);
+  setBrightnessLevel(brightnessTo);
 
   // Buzzer
   Serial << F("Init Buzzer...") << endl;
@@ -409,9 +948,370 @@ void setupRgb()
   //  digitalWrite(BUZZER, BUZZER_OFF);
   beep(50, 50, 50, 0);
 
+  // Output stage
+  Serial << F("Init Output...") << endl;
+  setBrightnessRampRGB(atoi(rgbBrightnessRamp));
+  setPowerBudgetRGB(atoi(rgbPowerBudget));
+  if (!setChannelCurrentRGB(rgbChannelCurrent))
+    setChannelCurrentRGB("250,250,250");
+  if (!setCurveRGB(rgbCurve))
+    setCurveRGB("linear");
+  if (!setCalibRGB(rgbCalib))
+    setCalibRGB("");
+  restartOutput();
+
   Serial << F("Setup RGB done.") << endl;
 } // setup
 
+/**********************************************************************
+  Effect registry access
+**********************************************************************/
+static uint8_t effectNameHash(const char *name)
+{
+  uint8_t h = 0;
+  while (*name)
+    h = h * 31 + *name++;
+  return h & (EFFECT_HASH_SIZE - 1);
+}
+
+void buildEffectHash(void)
+{
+  char name[16];
+
+  memset(effectHash, 0, sizeof(effectHash));
+  for (uint8_t i = 0; i < EFFECT_COUNT; i++)
+  {
+    strncpy_P(name, (PGM_P)pgm_read_ptr(&effects[i].name), sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+
+    uint8_t h = effectNameHash(name);
+    while (effectHash[h])
+      h = (h + 1) & (EFFECT_HASH_SIZE - 1);
+    effectHash[h] = i + 1;
+  }
+} // buildEffectHash
+
+uint8_t effectCountRGB(void)
+{
+  return EFFECT_COUNT;
+}
+
+uint8_t currentEffectRGB(void)
+{
+  return cycleMode;
+}
+
+bool getEffectRGB(uint8_t index, effect_st *e)
+{
+  if (index >= EFFECT_COUNT)
+    return false;
+
+  memcpy_P(e, &effects[index], sizeof(*e));
+  return true;
+}
+
+bool getEffectParamRGB(uint8_t index, uint8_t param, effect_param_st *p)
+{
+  effect_st e;
+
+  if (!getEffectRGB(index, &e) || param >= e.paramCount)
+    return false;
+
+  memcpy_P(p, &e.params[param], sizeof(*p));
+  return true;
+}
+
+/*
+  effectIndexRGB
+
+  Returns
+    index of the effect called name, -1 if there is none
+*/
+int8_t effectIndexRGB(const char *name)
+{
+  uint8_t h = effectNameHash(name);
+
+  while (effectHash[h])
+  {
+    uint8_t i = effectHash[h] - 1;
+    if (!strcmp_P(name, (PGM_P)pgm_read_ptr(&effects[i].name)))
+      return i;
+    h = (h + 1) & (EFFECT_HASH_SIZE - 1);
+  }
+  return -1;
+} // effectIndexRGB
+
+/*
+  effectCostRGB
+
+  Returns
+    estimated step cost per frame in us for the current number of strips
+*/
+uint16_t effectCostRGB(uint8_t index)
+{
+  effect_st e;
+
+  if (!getEffectRGB(index, &e))
+    return 0;
+
+  return e.costBaseUs + e.costStripUs * numStrips;
+}
+
+/*
+  setEffectParamRGB
+
+  Set a parameter of the current effect, value is clipped to its range
+
+  Returns
+    false if the current effect has no parameter called name
+*/
+bool setEffectParamRGB(const char *name, uint16_t value)
+{
+  effect_param_st p;
+
+  for (uint8_t k = 0; getEffectParamRGB(cycleMode, k, &p); k++)
+  {
+    if (!strcmp_P(name, p.name))
+    {
+      (*p.set)(constrain(value, p.min, p.max));
+      return true;
+    }
+  }
+
+  Serial << F("setEffectParamRGB: no parameter ") << name << endl;
+  return false;
+} // setEffectParamRGB
+
+/*---------------------------------------------------------------------
+  Layer stack
+---------------------------------------------------------------------*/
+const char blendNormalName[] PROGMEM = "normal";
+const char blendAddName[] PROGMEM = "add";
+const char blendMultiplyName[] PROGMEM = "multiply";
+const char blendMaxName[] PROGMEM = "max";
+
+const char *const blendNames[] PROGMEM = {blendNormalName, blendAddName, blendMultiplyName, blendMaxName};
+const uint8_t BLEND_COUNT = sizeof(blendNames) / sizeof(blendNames[0]);
+
+// Mask of strips first..first+count-1 within numStrips
+static uint64_t layerMask(const layer_st *l)
+{
+  if (l->first >= numStrips)
+    return 0;
+
+  uint8_t count = min(l->count, (uint8_t)(numStrips - l->first));
+  uint64_t mask = (count >= 64) ? ~(uint64_t)0 : ((uint64_t)1 << count) - 1;
+  return mask << l->first;
+}
+
+// Blend channel l of a layer onto b, 16 bit each
+static inline uint16_t blendChannel(uint16_t b, uint16_t l, uint8_t blend, uint8_t opacity)
+{
+  int32_t r;
+
+  switch (blend)
+  {
+  case blendAdd:
+    r = min(b + l, (int)FRAME_MAX);
+    break;
+  case blendMultiply:
+    r = ((uint32_t)b * (l + 1)) >> 16;
+    break;
+  case blendMax:
+    r = max(b, l);
+    break;
+  case blendNormal:
+  default:
+    r = l;
+    break;
+  }
+
+  // Weight 0..256: opacity 0 keeps b, 255 gives r exactly
+  return b + (((r - b) * (opacity + (opacity >> 7))) >> 8);
+}
+
+/*
+  renderLayers
+
+  Init or step the effects of all layers and composite them into
+  pca_rgb. With the base layer alone its effect draws into pca_rgb
+  directly, as without layers.
+*/
+void renderLayers(bool init, uint32_t dtUs)
+{
+  if (numLayers == 1)
+  {
+    if (init)
+      (*init_func)();
+    else
+      (*step_func)(dtUs);
+    return;
+  }
+
+  layers[0].needInit |= init;
+
+  uint64_t dirty = layersDirty;
+  bool scratch = false; // pca_rgb holds a layer frame
+  bool drawn = frameDirty; // Effects drawing on the scratch frame do not count
+
+  for (uint8_t k = 0; k < numLayers; k++)
+  {
+    layer_st *l = &layers[k];
+
+    if (!l->needInit && !l->animated)
+      continue;
+
+    // Effects draw on top of their last frame
+    memcpy(pca_rgb.rgb, l->frame, sizeof(rgb_st) * numStrips);
+    scratch = true;
+
+    if (l->needInit)
+    {
+      (*l->init)();
+      l->needInit = false;
+    }
+    else
+      (*l->step)(dtUs);
+
+    uint64_t mask = layerMask(l);
+    if (mask && memcmp(&pca_rgb.rgb[l->first], &l->frame[l->first], sizeof(rgb_st) * min(l->count, (uint8_t)(numStrips - l->first))))
+      dirty |= mask;
+
+    memcpy(l->frame, pca_rgb.rgb, sizeof(rgb_st) * numStrips);
+  }
+
+  bool changed = (dirty != 0);
+
+  for (uint8_t i = 0; dirty && i < numStrips; i++, dirty >>= 1)
+  {
+    if (!(dirty & 1))
+      continue;
+
+    rgb_st c = layers[0].frame[i];
+
+    for (uint8_t k = 1; k < numLayers; k++)
+    {
+      const layer_st *l = &layers[k];
+
+      if (i < l->first || i - l->first >= l->count)
+        continue;
+
+      c.r = blendChannel(c.r, l->frame[i].r, l->blend, l->opacity);
+      c.g = blendChannel(c.g, l->frame[i].g, l->blend, l->opacity);
+      c.b = blendChannel(c.b, l->frame[i].b, l->blend, l->opacity);
+    }
+
+    layerOut[i] = c;
+    layerStrips++;
+  }
+  layersDirty = 0;
+
+  if (scratch || changed)
+    memcpy(pca_rgb.rgb, layerOut, sizeof(rgb_st) * numStrips);
+  frameDirty = drawn || changed;
+} // renderLayers
+
+/*
+  setLayerRGB
+
+  Put effect on accent layer 1..MAX_LAYERS-1, replacing what is there.
+  A new layer must directly follow the existing ones. The layer covers
+  count strips from first, blend is one of normal, add, multiply, max.
+
+  Returns
+    false if a parameter is invalid, layers stay unchanged
+*/
+bool setLayerRGB(uint8_t layer, const char *effect, uint8_t first, uint8_t count, uint8_t opacity, const char *blend)
+{
+  effect_st e;
+  int8_t index = effectIndexRGB(effect);
+  int8_t mode = -1;
+
+  for (uint8_t m = 0; m < BLEND_COUNT; m++)
+    if (!strcmp_P(blend, (const char *)pgm_read_ptr(&blendNames[m])))
+      mode = m;
+
+  if (layer == 0 || layer >= MAX_LAYERS || layer > numLayers)
+  {
+    Serial << F("setLayerRGB: invalid layer ") << layer << endl;
+    return false;
+  }
+  if (index <= EFFECT_HOLD || !getEffectRGB(index, &e))
+  {
+    Serial << F("setLayerRGB: unknown effect ") << effect << endl;
+    return false;
+  }
+  if (mode < 0)
+  {
+    Serial << F("setLayerRGB: unknown blend mode ") << blend << endl;
+    return false;
+  }
+  for (uint8_t k = 0; k < numLayers; k++)
+  {
+    if (k != layer && (k ? layers[k].effect : cycleMode) == index)
+    {
+      Serial << F("setLayerRGB: ") << effect << F(" already runs on layer ") << k << endl;
+      return false;
+    }
+  }
+
+  // Going from one to several layers, pca_rgb holds the base frame
+  if (numLayers == 1)
+  {
+    memcpy(layers[0].frame, pca_rgb.rgb, sizeof(layers[0].frame));
+    layers[0].needInit = false;
+  }
+
+  layer_st *l = &layers[layer];
+  l->init = e.init;
+  l->step = e.step;
+  l->effect = index;
+  l->first = first;
+  l->count = count;
+  l->opacity = opacity;
+  l->blend = mode;
+  l->animated = (e.stepDelay != 0);
+  l->needInit = true;
+  memset(l->frame, 0, sizeof(l->frame));
+
+  if (layer == numLayers)
+    numLayers++;
+  layersDirty = ~(uint64_t)0;
+
+  Serial << F("Layer ") << layer << F(": ") << effect << F(" strips ") << first << F("+") << count
+         << F(" ") << blend << F(" ") << opacity << endl;
+  return true;
+} // setLayerRGB
+
+/*
+  removeLayer
+
+  Drop accent layer k, the ones above move down
+*/
+void removeLayer(uint8_t k)
+{
+  if (k == 0 || k >= numLayers)
+    return;
+
+  for (; k + 1 < numLayers; k++)
+    layers[k] = layers[k + 1];
+  numLayers--;
+
+  // Back to the base alone, it draws into pca_rgb again
+  if (numLayers == 1)
+  {
+    memcpy(pca_rgb.rgb, layers[0].frame, sizeof(layers[0].frame));
+    frameDirty = true;
+  }
+  layersDirty = ~(uint64_t)0;
+} // removeLayer
+
+void clearLayersRGB(void)
+{
+  while (numLayers > 1)
+    removeLayer(numLayers - 1);
+}
+
 /**********************************************************************
   Arduino Loop
   
@@ -456,42 +1356,66 @@ void loopRgb()
     newCommandAvail = false;
   }
 
+  rampBrightness();
+  updatePcaPower(false);
+
+  // Rewrite all PCAs now and then, idle or not
+  if (millis() - panelRefreshMs >= PANEL_REFRESH_MS)
+  {
+    panelRefreshMs = millis();
+    for (uint8_t c = 0; c < pcaChips; c++)
+      pcaShadow[c].valid = false;
+    frameDirty = true;
+  }
+
   //  if (loopCount > 1200) return;
 
   if (newCycleModeSelected)
   {
-    // Initialize new cycle mode first
-    (*init_func)();
+    // A prepared frame still shows the old mode, drop it
+    outFrameDrop();
+
+    // Initialize new cycle mode first and show it right away
+    renderLayers(true, 0);
     newCycleModeSelected = false;
-  }
-  else
-  {
-    // Execute step function of currently selected mode
-    (*step_func)();
+    updatePanel();
+    restartFrames();
+    return;
   }
 
-  if (stepDelay)
+  if (idleFrames >= IDLE_AFTER_FRAMES && !frameDirty && !outFailed)
   {
-    // Handle millis wrap around
-    // ### really necessary? I don't think so.
-    // Happens every 49d 17h 02m 47,295 - so what ...
-    //    if (millis() < lastStepTS)
-    //      lastStepTS = 0;
+    // Idle: look for changes at a slow pace, a change by a command
+    // (frameDirty) is picked up right away
+    uint32_t now = micros();
+    if ((int32_t)(now - idleNextUs) < 0)
+      return;
+    idleNextUs = now + IDLE_INTERVAL_US;
+    nextFrameUs = now + frameIntervalUs;
+  }
+  // Timed output: render once the prepared frame went out. The Ticker
+  // sets the pace, not frameDue.
+  else if (timedOutput ? outReady : !frameDue())
+    return;
 
-    uint32_t next_ts = lastStepTS + stepDelay;
+  // Execute step functions of currently selected mode and layers
+  renderLayers(false, frameDt());
 
-    // Did the calculation last longer than we intended to wait?
-    if (next_ts > millis())
-    { // No, so wait till delay is over
-      while (next_ts > millis())
-        ;
-      lastStepTS += stepDelay;
+  if (!frameDirty && !outFailed)
+  {
+    // Nothing changed, nothing to send. Until the loop slows down an
+    // empty frame keeps the cadence of the timed output.
+    idleSkipped++;
+    if (idleFrames < IDLE_AFTER_FRAMES)
+    {
+      if (timedOutput)
+        outFramePush();
+      if (++idleFrames == IDLE_AFTER_FRAMES)
+        idleNextUs = micros() + IDLE_INTERVAL_US;
     }
-    else
-      // Yes, reset for next iteration
-      // If not, the wait to time and the real time would drift apart
-      lastStepTS = millis();
+    return;
   }
+
   // Execute update
   updatePanel();
 
@@ -500,6 +1424,214 @@ void loopRgb()
   //  loopCount ++;
 } // loop
 
+/**********************************************************************
+  frameDue
+  
+  Deadline based frame scheduler. Returns true once per frame interval.
+  Deadlines advance by a fixed interval so there is no drift. If we
+  fell behind by more than a frame, skip the missed frames and restart
+  the cadence from now instead of trying to catch up.
+  Handles micros() wrap around.
+**********************************************************************/
+bool frameDue(void)
+{
+  if (!frameIntervalUs)
+    return true;
+
+  uint32_t now = micros();
+
+  if ((int32_t)(now - nextFrameUs) < 0)
+    return false;
+
+  nextFrameUs += frameIntervalUs;
+
+  if ((int32_t)(now - nextFrameUs) >= 0)
+  {
+    framesSkipped += (now - nextFrameUs) / frameIntervalUs + 1;
+    nextFrameUs = now + frameIntervalUs;
+  }
+
+  return true;
+} // frameDue
+
+/**********************************************************************
+  restartFrames
+  
+  Start a new frame cadence with the next frame due one interval from now
+**********************************************************************/
+void restartFrames(void)
+{
+  nextFrameUs = micros() + frameIntervalUs;
+
+  // Time since the last frame counts from here
+  lastStepUs = micros();
+  renderTick = rgbTelemetry.outTicks + outReady;
+} // restartFrames
+
+/**********************************************************************
+  frameDt
+  
+  Time in us the frame about to be rendered advances the animation.
+  Without timed output that is the time since the last step, frames
+  skipped by frameDue are made up for.
+  With timed output the clock is the output tick the frame goes out
+  on. After an underrun that tick is later than one tick after the
+  last frame, and the animation catches up.
+**********************************************************************/
+uint32_t frameDt(void)
+{
+  if (!timedOutput)
+  {
+    uint32_t now = micros();
+    uint32_t dt = now - lastStepUs;
+    lastStepUs = now;
+    return dt;
+  }
+
+  uint32_t tick = rgbTelemetry.outTicks + outReady + 1;
+  uint32_t ticks = max((int32_t)(tick - renderTick), (int32_t)1);
+
+  renderTick += ticks;
+  return ticks * outIntervalUs;
+} // frameDt
+
+/**********************************************************************
+  restartOutput
+  
+  (Re)arm the output Ticker for the current frame interval and start
+  the interval statistics over. Ticker has a resolution of 1ms, so the
+  output rate is rounded to full milliseconds.
+**********************************************************************/
+void restartOutput(void)
+{
+  outputTicker.detach();
+
+  // Do not lose the prepared frame, its changes are in the shadows already
+  if (!timedOutput && outReady)
+    outputTick();
+
+  memset(outHist, 0, sizeof(outHist));
+  outHistBinUs = max(frameIntervalUs / 16, (uint32_t)1);
+  outLastUs = 0;
+  rgbTelemetry.outFrames = rgbTelemetry.outUnderruns = 0;
+  rgbTelemetry.outMinUs = rgbTelemetry.outMaxUs = 0;
+
+  outIntervalUs = max((frameIntervalUs + 500) / 1000, (uint32_t)1) * 1000;
+  if (timedOutput)
+    outputTicker.attach_ms(outIntervalUs / 1000, outputTick);
+} // restartOutput
+
+/**********************************************************************
+  outputTick
+  
+  Ticker callback of the output stage. Sends the prepared frame, if
+  there is one, and records the interval since the last frame. No Serial output here, errors are flagged in outFailed.
+**********************************************************************/
+void outputTick(void)
+{
+  rgbTelemetry.outTicks++;
+
+  if (!outReady)
+  {
+    if (idleFrames < IDLE_AFTER_FRAMES)
+      rgbTelemetry.outUnderruns++;
+    return;
+  }
+
+  uint32_t now = micros();
+
+  if (pca_send_frame(outFrame, outFrameLen))
+  {
+    rgbTelemetry.iicErrors++;
+    outFailed = true;
+  }
+  recordTx(micros() - now);
+  if (outFrameTouched > 1)
+    recordSkew(0);
+  applyOe(outFrameOe);
+  outReady = false;
+
+  if (rgbTelemetry.outFrames++)
+  {
+    uint32_t us = now - outLastUs;
+
+    if (rgbTelemetry.outFrames == 2 || us < rgbTelemetry.outMinUs)
+      rgbTelemetry.outMinUs = us;
+    rgbTelemetry.outMaxUs = max(rgbTelemetry.outMaxUs, us);
+
+    uint8_t bin = min(us / outHistBinUs, (uint32_t)OUT_HIST_BINS - 1);
+    if (outHist[bin] < 0xFFFF)
+      outHist[bin]++;
+  }
+  outLastUs = now;
+} // outputTick
+
+/**********************************************************************
+  outFramePush
+  
+  Move the queued writes of a frame into the prepared frame. Only
+  while outReady is clear, the Ticker does not touch it then.
+**********************************************************************/
+void outFramePush(void)
+{
+  outFrameLen = 0;
+  outFrameOe = oeLevel;
+  for (uint16_t i = 0; i < iicSegmentCount; i++)
+  {
+    outFrame[outFrameLen++] = iicSegments[i].addr;
+    outFrame[outFrameLen++] = iicSegments[i].len;
+    memcpy(&outFrame[outFrameLen], &iicQueue[iicSegments[i].pos], iicSegments[i].len);
+    outFrameLen += iicSegments[i].len;
+  }
+
+  iicQueueLen = 0;
+  iicSegmentCount = 0;
+
+  outReady = true;
+} // outFramePush
+
+/**********************************************************************
+  outFrameDrop
+  
+  Drop the prepared frame if not sent yet. Its changes are in the
+  shadows already, so the next frame has to be written in full.
+**********************************************************************/
+void outFrameDrop(void)
+{
+  if (!outReady)
+    return;
+
+  outReady = false;
+
+  for (uint8_t c = 0; c < PCA_MAX_CHIPS; c++)
+    pcaShadow[c].valid = false;
+} // outFrameDrop
+
+/**********************************************************************
+  outIntervalP99RGB
+  
+  99th percentile of the interval between two output frames in us.
+  Upper edge of the histogram bin, max for the overflow bin.
+**********************************************************************/
+uint32_t outIntervalP99RGB(void)
+{
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < OUT_HIST_BINS; i++)
+    total += outHist[i];
+
+  if (!total)
+    return 0;
+
+  uint32_t sum = 0;
+  for (uint8_t i = 0; i < OUT_HIST_BINS - 1; i++)
+  {
+    sum += outHist[i];
+    if (sum * 100 >= total * 99)
+      return min((i + 1) * outHistBinUs, rgbTelemetry.outMaxUs);
+  }
+  return rgbTelemetry.outMaxUs;
+} // outIntervalP99RGB
+
 /**********************************************************************
   putNewCommand
 
@@ -549,10 +1681,16 @@ void enableRGB(bool state)
   return;
 }
 
-void setModeRGB(uint8_t mode)
+void setModeRGB(int8_t mode)
 {
 
-  newCycleModeSelected = true;
+  // -1: next, -2: previous effect, noChange is left out
+  if (mode == -1)
+    mode = (cycleMode >= EFFECT_COUNT - 1) ? 1 : cycleMode + 1;
+  else if (mode == -2)
+    mode = (cycleMode <= 1) ? EFFECT_COUNT - 1 : cycleMode - 1;
+
+  setCycleMode(mode);
 
   return;
 }
@@ -563,11 +1701,83 @@ void persistBrightness()
   EEPROM.commit();
 }
 
+/*---------------------------------------------------------------------
+  setBrightnessLevel
+  
+  Split a level (Q16, 65535 full on) between /OE and the frame scale.
+  Off switches /OE off and keeps the frame scale, no bus traffic.
+  Either change needs a frame, /OE goes out with it.
+---------------------------------------------------------------------*/
+void setBrightnessLevel(uint16_t level)
+{
+  uint8_t oe = 0;
+  uint32_t scale = frameScale;
+
+  if (level >= OE_MIN_LEVEL)
+  {
+    oe = ((uint32_t)level * OE_PWM_RANGE + 32767) / 65535;
+    scale = 65536;
+  }
+  else if (level)
+  {
+    oe = OE_MIN;
+    scale = ((uint32_t)level << 16) / OE_MIN_LEVEL;
+  }
+
+  if (scale != frameScale || oe != oeLevel)
+    frameDirty = true;
+  frameScale = scale;
+  oeLevel = oe;
+
+  brightnessLevel = level;
+} // setBrightnessLevel
+
+/*---------------------------------------------------------------------
+  applyOe
+  
+  Set /OE for the frame just sent. No Serial output, also called by
+  the output Ticker.
+---------------------------------------------------------------------*/
+void applyOe(uint8_t oe)
+{
+  if (oe == oeOut)
+    return;
+
+  // /OE is active low
+  oeOut = oe;
+  if (!oeGated)
+    analogWrite(PWM_OE_PIN, OE_PWM_RANGE - oe);
+} // applyOe
+
+/*---------------------------------------------------------------------
+  rampBrightness
+  
+  Move the level along the ramp, called every loop
+---------------------------------------------------------------------*/
+void rampBrightness(void)
+{
+  if (brightnessLevel == brightnessTo)
+    return;
+
+  uint32_t t = millis() - brightnessStartMs;
+  uint16_t level = brightnessTo;
+
+  if (t < brightnessRampMs)
+    level = brightnessFrom + ((int32_t)brightnessTo - brightnessFrom) * (int64_t)t / brightnessRampMs;
+
+  setBrightnessLevel(level);
+} // rampBrightness
+
 void setAbsoluteBrightnessRGB(uint8_t value)
 {
 
   pwm_oe = value;
 
+  // Ramp from where the level is now, even mid ramp
+  brightnessFrom = brightnessLevel;
+  brightnessTo = (255 - pwm_oe) * 257;
+  brightnessStartMs = millis();
+
   Serial << F("Set absolute PWM_OE to ") << pwm_oe << endl;
 
   persistBrightness();
@@ -585,13 +1795,19 @@ void setRelativeBrightnessRGB(int16_t value)
   if (tmp > 255)
     tmp = 255;
 
-  Serial << F("Set relative PWM_OE to ") << pwm_oe << endl;
-
-  persistBrightness();
+  setAbsoluteBrightnessRGB(tmp);
 
   return;
 }
 
+void setBrightnessRampRGB(uint16_t ms)
+{
+  // 0 jumps to the new level right away
+  brightnessRampMs = ms;
+
+  Serial << F("Set brightness ramp to ") << brightnessRampMs << F("ms") << endl;
+}
+
 void persistStepDelay()
 {
   EEPROM.write(EEPROM_ADDR_SPEED, ((uint8_t *)(&stepDelay))[0]);
@@ -599,14 +1815,37 @@ void persistStepDelay()
   EEPROM.commit();
 }
 
-void setAbsoluteSpeedRGB(uint8_t value)
+// Read back by the EEPROM block of setup, disabled for now like the
+// other persisted values
+void persistSpeed()
 {
+  EEPROM.write(EEPROM_ADDR_HUE_SPEED, ((uint8_t *)(&hueSpeed))[0]);
+  EEPROM.write(EEPROM_ADDR_HUE_SPEED + 1, ((uint8_t *)(&hueSpeed))[1]);
+  EEPROM.commit();
+}
 
-  stepDelay = value;
+/*
+  setHueSpeed
 
-  Serial << F("Set absolute stepDelay to ") << stepDelay << endl;
+  speed in hue cycles per minute x10, independent of the frame rate
+*/
+void setHueSpeed(uint16_t speed)
+{
+  hueSpeed = min(speed, HUE_SPEED_MAX);
 
-  persistStepDelay();
+  // 65536 hue x 65536 fraction per cycle, 60e6 us per minute, speed x10
+  hueRateQ16 = ((uint64_t)hueSpeed << 48) / 600000000;
+}
+
+void setAbsoluteSpeedRGB(uint16_t value)
+{
+
+  setHueSpeed(value);
+  speedSet = true;
+
+  Serial << F("Set absolute speed to ") << hueSpeed << F(" (x0.1 hue cycles/min)") << endl;
+
+  persistSpeed();
 
   return;
 }
@@ -614,153 +1853,544 @@ void setAbsoluteSpeedRGB(uint8_t value)
 void setRelativeSpeedRGB(int16_t value)
 {
 
-  int16_t tmp = stepDelay + value;
+  int32_t tmp = hueSpeed + value;
 
   if (tmp < 0)
     tmp = 0;
-  if (tmp > 255)
-    tmp = 255;
 
-  Serial << F("Set relative stepDelay to ") << stepDelay << endl;
+  setHueSpeed(tmp);
+  speedSet = true;
 
-  persistStepDelay();
+  Serial << F("Set relative speed to ") << hueSpeed << F(" (x0.1 hue cycles/min)") << endl;
+
+  persistSpeed();
 
   return;
 }
 
-void persistBeep()
+/*
+  topologyMap
+
+  Strip map of a topology
+  strips > 0 and empty topology: pack channels densely from PCA_BASE_ADDRESS on
+  topology given: see parseTopology, strips is ignored
+
+  Returns
+    false if strips or topology is invalid
+*/
+bool topologyMap(uint8_t strips, const char *topology, strip_map_st *map, uint8_t *n)
 {
-  EEPROM.write(EEPROM_ADDR_DOBEEP, doBeep);
-  EEPROM.commit();
+  *n = strips;
+
+  if (topology && topology[0])
+    return parseTopology(topology, map, n);
+
+  if (strips == 0 || strips > MAX_STRIPS)
+  {
+    Serial << F("topologyMap: invalid number of strips ") << strips << endl;
+    return false;
+  }
+  for (uint8_t k = 0; k < strips * 3; k++)
+  {
+    map[k / 3].addr[k % 3] = PCA_BASE_ADDRESS + k / PCA_CHANNELS;
+    map[k / 3].channel[k % 3] = k % PCA_CHANNELS;
+    map[k / 3].batch = 0;
+  }
+  return true;
+} // topologyMap
+
+/*
+  checkTopologyRGB
+
+  Check strips and topology as setTopologyRGB takes them, nothing is
+  applied. For the configuration form.
+*/
+bool checkTopologyRGB(uint8_t strips, const char *topology)
+{
+  strip_map_st map[MAX_STRIPS];
+  uint8_t n;
+
+  return topologyMap(strips, topology, map, &n) && buildPanelPlan(map, n, false);
+} // checkTopologyRGB
+
+/*
+  setTopologyRGB
+
+  Wiring of the strips, see topologyMap
+*/
+bool setTopologyRGB(uint8_t strips, const char *topology)
+{
+  strip_map_st map[MAX_STRIPS];
+  uint8_t n;
+
+  if (!topologyMap(strips, topology, map, &n) || !buildPanelPlan(map, n))
+    return false;
+
+  memcpy(stripMap, map, sizeof(map[0]) * n);
+  numStrips = n;
+  dutySumValid = false;
+
+  // Strips that are new to the effects start dark
+  for (uint8_t i = n; i < MAX_STRIPS; i++)
+    pca_rgb.rgb[i].r = pca_rgb.rgb[i].g = pca_rgb.rgb[i].b = 0;
+  frameDirty = true;
+
+  Serial << F("Set topology: ") << numStrips << F(" strips on ") << pcaChips << F(" PCAs") << endl;
+
+  // PCAs added at runtime need their mode registers set up
+  if (panelInitialized)
+    initPanel();
+
+  // Let the current cycle mode and the layers start over on the new layout
+  newCycleModeSelected = true;
+  for (uint8_t k = 1; k < numLayers; k++)
+    layers[k].needInit = true;
+
+  return true;
 }
 
-void enableBeepRGB()
+void setIicMaxFreqRGB(uint16_t freq)
 {
 
-  doBeep = 1;
+  Serial << F("Requalify IIC bus up to ") << freq << F("kHz") << endl;
 
-  Serial << F("Set doBeep to ") << doBeep << endl;
+  qualifyBus(freq);
 
-  persistBeep();
+  return;
+}
+
+void setPhaseStaggerRGB(bool state)
+{
+
+  phaseStagger = state;
+  frameDirty = true;
+
+  Serial << F("Set phase stagger to ") << phaseStagger << endl;
 
   return;
 }
 
-void disableBeepRGB()
+void setSyncOutputRGB(bool state)
 {
 
-  doBeep = 0;
+  syncOutput = state;
 
-  Serial << F("Set doBeep to ") << doBeep << endl;
+  // Start over to compare skew before and after
+  skewFrames = skewLastUs = skewMaxUs = skewSumUs = 0;
+  rgbTelemetry.txLastUs = rgbTelemetry.txMaxUs = 0;
 
-  persistBeep();
+  Serial << F("Set synchronized output to ") << syncOutput << endl;
 
   return;
 }
 
-/**********************************************************************
-  processSerialInput
-  
-  Processes commands from serial input
-  Returns 
-    1 on success
-    0 on invalid code given
-  
-  Initialize function pointers for each mode
-    init_func
-    step_func
-  Mark as newCycleModeSelected
-  
-  0 .. 9  Program modes
-    0 All Off
-    1 All On
-    2 All red
-    3 All green
-    4 All blue
-    5 Uniform
-    6 Cloud
-    7 Wave
-    8 -
-    9 -
-  !   Set program to on hold
-  b, B  Brightness
-    b Decrease brightness
-    B Increase brightness
-  s, S  Speed
-    s Decrease speed
-    S Increase speed
-  d   Dump
-**********************************************************************/
-uint8_t processSerialInput(char c)
+void setTimedOutputRGB(bool state)
 {
-  Serial << F("processInput: '") << c << "' " << endl;
-  Serial.print((uint8_t)c, HEX);
-  Serial.println('.');
 
-  uint8_t res = 1; // assume we have got a valid code
+  timedOutput = state;
+  restartOutput();
 
-  Serial << F("Selected mode:") << endl;
-  switch (c)
-  {
-  // Cycle Mode changes
-  case '0':
-    setCycleMode(allOff);
-    break;
-  case '1':
-    setCycleMode(allOn);
-    break;
-  case '2':
-    setCycleMode(red);
-    break;
-  case '3':
-    setCycleMode(green);
-    break;
-  case '4':
-    setCycleMode(blue);
-    break;
-  case '5':
-    setCycleMode(uniform);
-    break;
-  case '6':
-    setCycleMode(cloud);
-    break;
-  case '7':
-    setCycleMode(wave);
-    break;
-    /*  case '8':
-    setCycleMode(allOff);
-    break;
-  case '9':
-    setCycleMode(allOff);
-    break;
-*/
-  case 'd': // dump/debug ...
-    setCycleMode(debug);
-    break;
+  Serial << F("Set timed output to ") << timedOutput << endl;
 
-  case '!': // onHold ### new variable
-    if (cycleMode == noChange)
-    {
-      cycleMode = cycleModeOld;
-    }
-    else
-    {
-      cycleModeOld = cycleMode;
-      cycleMode = noChange;
-    }
-    newCycleModeSelected = true;
-    break;
-  // Execution control
-  case 'b': // dim brightness
-    setRelativeBrightnessRGB(-10);
-    break;
-  case 'B':
-    setRelativeBrightnessRGB(10);
-    break;
-  case 's': // speed
-    setRelativeSpeedRGB(-1);
-    break;
-  case 'S':
+  return;
+}
+
+void setTimelineRGB(const char *path)
+{
+
+  strncpy(timeline::timelineFile, path, timeline::TIMELINE_FILE_STR_LEN - 1);
+  timeline::timelineFile[timeline::TIMELINE_FILE_STR_LEN - 1] = '\0';
+
+  Serial << F("Set timeline to ") << timeline::timelineFile << endl;
+
+  setCycleMode(effectIndexRGB("timeline"));
+
+  return;
+}
+
+void seekTimelineRGB(uint32_t ms)
+{
+
+  if (!timeline::seek(ms))
+    Serial << F("Timeline not playing") << endl;
+
+  return;
+}
+
+void setCloudHoldRGB(uint16_t ms)
+{
+
+  cloudHoldMs = ms;
+
+  Serial << F("Set cloud hold to ") << cloudHoldMs << F("ms") << endl;
+
+  return;
+}
+
+void setCloudDurationRGB(uint16_t ms)
+{
+
+  // Takes effect with the next fade
+  cloudFadeMs = max(ms, (uint16_t)1);
+
+  Serial << F("Set cloud fade duration to ") << cloudFadeMs << F("ms") << endl;
+
+  return;
+}
+
+void setCloudFadeRGB(uint16_t fade)
+{
+
+  // Takes effect with the next fade
+  cloudFade = (fade == fadeOklab) ? fadeOklab : fadeHsv;
+
+  Serial << F("Set cloud fade to ") << (cloudFade == fadeOklab ? F("OKLab") : F("HSV")) << endl;
+
+  return;
+}
+
+void setDitherRGB(uint16_t below)
+{
+
+  // Dither channels below this 12 bit value, 0 turns dithering off.
+  // Up to 4095, a carry then tops out at full duty.
+  ditherBelow = min(below, (uint16_t)4095);
+  frameDirty = true;
+  memset(ditherErr, 0, sizeof(ditherErr));
+
+  Serial << F("Set dither below ") << ditherBelow << endl;
+
+  return;
+}
+
+/*
+  checkCurveRGB
+
+  Returns
+    true if name is an output curve
+*/
+bool checkCurveRGB(const char *name)
+{
+  for (uint8_t i = 0; i < CURVE_COUNT; i++)
+    if (!strcmp_P(name, (const char *)pgm_read_ptr(&curveNames[i])))
+      return true;
+  return false;
+} // checkCurveRGB
+
+/*
+  setCurveRGB
+
+  Select the output curve by name: linear, gamma22, gamma28, cie
+
+  Returns
+    false if there is no such curve, the current one stays
+*/
+bool setCurveRGB(const char *name)
+{
+  for (uint8_t i = 0; i < CURVE_COUNT; i++)
+  {
+    if (!strcmp_P(name, (const char *)pgm_read_ptr(&curveNames[i])))
+    {
+      curveLut = (const uint16_t *)pgm_read_ptr(&curveLuts[i]);
+      frameDirty = true;
+      Serial << F("Set output curve to ") << name << endl;
+      return true;
+    }
+  }
+
+  Serial << F("setCurveRGB: unknown curve ") << name << endl;
+  return false;
+} // setCurveRGB
+
+/*
+  calibFromString
+
+  Calibration of all CALIB_BATCHES batches, see parseCalib. Batches
+  missing in calibration are identity.
+*/
+bool calibFromString(const char *calibration, calib_st *cal)
+{
+  for (uint8_t b = 0; b < CALIB_BATCHES; b++)
+  {
+    for (uint8_t k = 0; k < 9; k++)
+      cal[b].m[k] = (k % 4) ? 0 : 4096;
+    cal[b].max[0] = cal[b].max[1] = cal[b].max[2] = 0xFFFF;
+    cal[b].kind = calibIdentity;
+  }
+
+  return parseCalib(calibration, cal);
+} // calibFromString
+
+bool checkCalibRGB(const char *calibration)
+{
+  calib_st cal[CALIB_BATCHES];
+
+  return calibFromString(calibration, cal);
+} // checkCalibRGB
+
+/*
+  setCalibRGB
+
+  Set the colour calibration of all batches, see calibFromString.
+
+  Returns
+    false on error, the current calibration stays
+*/
+bool setCalibRGB(const char *calibration)
+{
+  calib_st cal[CALIB_BATCHES];
+
+  if (!calibFromString(calibration, cal))
+    return false;
+
+  memcpy(calib, cal, sizeof(calib));
+  frameDirty = true;
+
+  Serial << F("Set calibration: ") << calibration << endl;
+  return true;
+} // setCalibRGB
+
+/*
+  pwmFreqHz
+
+  PWM frequency of a preset name (default, camera, highspeed) or Hz
+  from PWM_FREQ_MIN to PWM_FREQ_MAX
+
+  Returns
+    Hz, 0 if freq is invalid
+*/
+uint16_t pwmFreqHz(const char *freq)
+{
+  for (uint8_t i = 0; i < PWM_PRESET_COUNT; i++)
+    if (!strcmp_P(freq, (const char *)pgm_read_ptr(&pwmPresets[i].name)))
+      return pgm_read_word(&pwmPresets[i].hz);
+
+  char *end;
+  uint32_t hz = strtoul(freq, &end, 10);
+  if (end == freq || *end || hz < PWM_FREQ_MIN || hz > PWM_FREQ_MAX)
+  {
+    Serial << F("pwmFreqHz: need a preset or ") << PWM_FREQ_MIN << F("..") << PWM_FREQ_MAX << F("Hz") << endl;
+    return 0;
+  }
+  return hz;
+} // pwmFreqHz
+
+bool checkPwmFreqRGB(const char *freq)
+{
+  return pwmFreqHz(freq) != 0;
+} // checkPwmFreqRGB
+
+/*
+  setPwmFreqRGB
+
+  PWM frequency of the PCAs, see pwmFreqHz. Live changes go through
+  pca_set_prescale.
+
+  Returns
+    false if freq is invalid, the frequency stays
+*/
+bool setPwmFreqRGB(const char *freq)
+{
+  uint32_t hz = pwmFreqHz(freq);
+
+  if (!hz)
+    return false;
+
+  uint8_t prescale = (PCA_OSC_HZ + 2048 * hz) / (4096 * hz) - 1;
+  if (prescale == pcaPrescale)
+    return true;
+  pcaPrescale = prescale;
+
+  Serial << F("Set PWM frequency to ") << PCA_OSC_HZ / (4096UL * (pcaPrescale + 1))
+         << F("Hz, prescale ") << pcaPrescale << endl;
+
+  if (panelInitialized)
+    pca_set_prescale();
+  return true;
+} // setPwmFreqRGB
+
+void setPowerBudgetRGB(uint16_t ma)
+{
+  // 0 turns the limiter off
+  powerBudgetMa = ma;
+  frameDirty = true;
+
+  Serial << F("Set power budget to ") << powerBudgetMa << F("mA") << endl;
+}
+
+/*
+  parseChannelCurrent
+
+  "r,g,b" current in mA of one strip's channel at full duty
+
+  Returns
+    false if the string is invalid
+*/
+bool parseChannelCurrent(const char *current, uint16_t *ma)
+{
+  const char *p = current;
+  char *end;
+
+  for (uint8_t k = 0; k < 3; k++)
+  {
+    uint32_t v = strtoul(p, &end, 10);
+    if (end == p || v > 10000 || (k < 2 && *end != ','))
+    {
+      Serial << F("parseChannelCurrent: need r,g,b up to 10000mA") << endl;
+      return false;
+    }
+    ma[k] = v;
+    p = end + 1;
+  }
+  return true;
+} // parseChannelCurrent
+
+bool checkChannelCurrentRGB(const char *current)
+{
+  uint16_t ma[3];
+
+  return parseChannelCurrent(current, ma);
+} // checkChannelCurrentRGB
+
+/*
+  setChannelCurrentRGB
+
+  Current of one strip's channels, see parseChannelCurrent
+
+  Returns
+    false if the string is invalid, the current values are kept
+*/
+bool setChannelCurrentRGB(const char *current)
+{
+  uint16_t ma[3];
+
+  if (!parseChannelCurrent(current, ma))
+    return false;
+
+  memcpy(channelMa, ma, sizeof(channelMa));
+  frameDirty = true;
+
+  Serial << F("Set channel current: ") << current << endl;
+  return true;
+} // setChannelCurrentRGB
+
+void setFpsRGB(uint8_t fps)
+{
+
+  // 0 fps: run frames as fast as possible
+  fpsSet = true;
+  frameIntervalUs = fps ? 1000000UL / fps : 0;
+  stepDelay = (frameIntervalUs + 500) / 1000;
+  restartOutput();
+
+  // The old deadline may be far off, from 0 fps it was never advanced
+  restartFrames();
+
+  Serial << F("Set fps to ") << fps << F(" (") << frameIntervalUs << F("us)") << endl;
+
+  persistStepDelay();
+
+  return;
+}
+
+void persistBeep()
+{
+  EEPROM.write(EEPROM_ADDR_DOBEEP, doBeep);
+  EEPROM.commit();
+}
+
+void enableBeepRGB()
+{
+
+  doBeep = 1;
+
+  Serial << F("Set doBeep to ") << doBeep << endl;
+
+  persistBeep();
+
+  return;
+}
+
+void disableBeepRGB()
+{
+
+  doBeep = 0;
+
+  Serial << F("Set doBeep to ") << doBeep << endl;
+
+  persistBeep();
+
+  return;
+}
+
+/**********************************************************************
+  processSerialInput
+  
+  Processes commands from serial input
+  Returns 
+    1 on success
+    0 on invalid code given
+  
+  Initialize function pointers for each mode
+    init_func
+    step_func
+  Mark as newCycleModeSelected
+  
+  0 .. 9  Program modes
+    0 All Off
+    1 All On
+    2 All red
+    3 All green
+    4 All blue
+    5 Uniform
+    6 Cloud
+    7 Wave
+    8 -
+    9 -
+  !   Set program to on hold
+  b, B  Brightness
+    b Decrease brightness
+    B Increase brightness
+  s, S  Speed
+    s Decrease speed
+    S Increase speed
+  d   Dump
+  i   Dump structures and IIC statistics
+  p   HSV conversion perf test
+**********************************************************************/
+uint8_t processSerialInput(char c)
+{
+  Serial << F("processInput: '") << c << "' " << endl;
+  Serial.print((uint8_t)c, HEX);
+  Serial.println('.');
+
+  uint8_t res = 1; // assume we have got a valid code
+
+  Serial << F("Selected mode:") << endl;
+  switch (c)
+  {
+  case '!': // onHold
+    if (cycleMode == EFFECT_HOLD)
+    {
+      setCycleMode(cycleModeOld);
+    }
+    else
+    {
+      cycleModeOld = cycleMode;
+      setCycleMode(EFFECT_HOLD);
+    }
+    break;
+  // Execution control
+  case 'b': // dim brightness
+    setRelativeBrightnessRGB(-10);
+    break;
+  case 'B':
+    setRelativeBrightnessRGB(10);
+    break;
+  case 's': // speed
+    setRelativeSpeedRGB(-1);
+    break;
+  case 'S':
     setRelativeSpeedRGB(1);
     break;
   case 'g':
@@ -780,738 +2410,2030 @@ uint8_t processSerialInput(char c)
   case 'E':
     initEEPROM(0, 0, 16); // value, from, count
     break;
+  case 'i':
+    dump_structures();
+    break;
+  case 'p':
+    hsvPerfTest();
+    effectPerfTest();
+    break;
   case '?':
     dumpHelp();
     break;
   default:
-    Serial << F("Command not implemented: '") << c << "'. Use '?' for help.\n";
+    // Cycle mode changes
     res = 0;
+    for (uint8_t i = 0; i < EFFECT_COUNT; i++)
+    {
+      if (c && pgm_read_byte(&effects[i].key) == c)
+      {
+        setCycleMode(i);
+        res = 1;
+        break;
+      }
+    }
+    if (!res)
+      Serial << F("Command not implemented: '") << c << "'. Use '?' for help.\n";
     break;
   }
 
-  Serial << F("processSerialInput: done.") << endl;
+  Serial << F("processSerialInput: done.") << endl;
+
+  if (res)
+    beep(50, 50, 50, 0, 0);
+  else
+    beep(100, 50, 100, 0, 0);
+
+  return res;
+} // processSerialInput
+
+void dumpHelp()
+{
+  effect_st e;
+
+  for (uint8_t i = 0; i < EFFECT_COUNT; i++)
+  {
+    getEffectRGB(i, &e);
+    if (e.key)
+      Serial << e.key << ' ' << FPSTR(e.name) << endl;
+  }
+
+  Serial << F(
+      "! Hold/resume\n"
+      "b Increase Brightness\n"
+      "B Decrease Brightness\n"
+      "s Decrease Speed\n"
+      "S Increase Speed\n"
+      "g Enable Beep\n"
+      "G Disable Beep\n"
+      "@ Software Reset\n"
+      "e Dump EEPROM\n"
+      "E Reinit EEPROM\n"
+      "i Dump structures and IIC statistics\n"
+      "p HSV conversion and effect perf test\n"
+      "? This help\n");
+} // dumpHelp
+
+/*---------------------------------------------------------------------
+  setCycleMode
+  
+  Sets one of the allowed cycle modes
+  Ignores setting if cycle already in progress
+
+  Returns
+    0 invalid cycle mode
+    1 cycle mode set
+---------------------------------------------------------------------*/
+uint8_t setCycleMode(uint8_t cm)
+{
+  effect_st e;
+
+  if (!getEffectRGB(cm, &e))
+  {
+    Serial << F("Cycle mode not implemented: ") << cm << ".\n";
+    newCycleModeSelected = false;
+    return 0;
+  }
+
+  init_func = e.init;
+  step_func = e.step;
+  Serial.println(FPSTR(e.name));
+
+  // An effect runs on one layer at most, the base wins
+  for (uint8_t k = numLayers - 1; k > 0; k--)
+  {
+    if (layers[k].effect == cm)
+    {
+      Serial << F("Drop layer ") << k << endl;
+      removeLayer(k);
+    }
+  }
+  layers[0].init = init_func;
+  layers[0].step = step_func;
+  layers[0].effect = cm;
+  layers[0].animated = (e.stepDelay != 0);
+
+  // Animated effects come with their own frame rate, unless set/fps
+  // chose one
+  if (!fpsSet && e.stepDelay && e.stepDelay != stepDelay)
+  {
+    stepDelay = e.stepDelay;
+    frameIntervalUs = stepDelay * 1000UL;
+    restartOutput();
+    restartFrames();
+  }
+  if (e.speed && !speedSet)
+    setHueSpeed(e.speed);
+
+  // We have a valid new cycle mode
+  newCycleModeSelected = true; // Initialize in loop on next pass
+  cycleMode = cm;              // Store new cycle mode
+
+  // Persist new cycleMode to EEPROM
+  EEPROM.write(EEPROM_ADDR_CYCLEMODE, cycleMode);
+  EEPROM.commit();
+
+  return 1;
+} // setCycleMode
+
+void dump_structures(void)
+{
+  char buff[96]; // Longest line with all values at their max is ~80
+
+  Serial.println(F("----------"));
+  snprintf(buff, sizeof(buff), "Loop Count: %u\n", loopCount);
+  Serial.print(buff);
+
+  snprintf(buff, sizeof(buff), "Cloud fade: %uus of %uus\n", cloudFadeUs, cloudFadeLenUs);
+  Serial.print(buff);
+
+  snprintf(buff, sizeof(buff), "Frame interval: %uus skipped: %u\n", frameIntervalUs, framesSkipped);
+  Serial.print(buff);
+
+  snprintf(buff, sizeof(buff), "Idle: %u frames not sent: %u\n", idleFrames >= IDLE_AFTER_FRAMES, idleSkipped);
+  Serial.print(buff);
+
+  snprintf(buff, sizeof(buff), "PCAs asleep: %u of %u /OE gated: %u\n", pcaSleeping, pcaChips, oeGated);
+  Serial.print(buff);
+
+  snprintf(buff, sizeof(buff), "PWM: %uHz prescale: %u\n", (uint32_t)(PCA_OSC_HZ / (4096UL * (pcaPrescale + 1))), pcaPrescale);
+  Serial.print(buff);
+
+  snprintf(buff, sizeof(buff), "Hue speed: %u.%u cycles/min\n", hueSpeed / 10, hueSpeed % 10);
+  Serial.print(buff);
+
+  for (uint8_t c = 0; c < pcaChips; c++)
+  {
+    snprintf(buff, sizeof(buff), "PCA %02X: %u channels\n", pcaPlan[c].addr, pcaPlan[c].count);
+    Serial.print(buff);
+  }
+
+  snprintf(buff, sizeof(buff), "Sync: %u stagger: %u skew last: %uus max: %uus avg: %uus\n",
+           syncOutput, phaseStagger, skewLastUs, skewMaxUs, skewFrames ? skewSumUs / skewFrames : 0);
+  Serial.print(buff);
+
+  snprintf(buff, sizeof(buff), "One transaction frames last: %uus max: %uus\n", rgbTelemetry.txLastUs, rgbTelemetry.txMaxUs);
+  Serial.print(buff);
+
+  snprintf(buff, sizeof(buff), "Timed output: %u frames: %u\n", timedOutput, rgbTelemetry.outFrames);
+  Serial.print(buff);
+
+  snprintf(buff, sizeof(buff), "Prepared: %u underruns: %u\n", outReady, rgbTelemetry.outUnderruns);
+  Serial.print(buff);
+
+  snprintf(buff, sizeof(buff), "Output interval min: %uus p99: %uus max: %uus\n",
+           rgbTelemetry.outMinUs, outIntervalP99RGB(), rgbTelemetry.outMaxUs);
+  Serial.print(buff);
+
+  for (uint8_t k = 1; k < numLayers; k++)
+  {
+    effect_st e;
+    getEffectRGB(layers[k].effect, &e);
+    Serial << F("Layer ") << k << F(": ") << FPSTR(e.name) << F(" strips ") << layers[k].first << F("+") << layers[k].count
+           << F(" ") << FPSTR((const char *)pgm_read_ptr(&blendNames[layers[k].blend])) << F(" ") << layers[k].opacity << endl;
+  }
+
+  snprintf(buff, sizeof(buff), "Layers: %u strips composited: %u\n", numLayers, layerStrips);
+  Serial.print(buff);
+
+  snprintf(buff, sizeof(buff), "Dither below: %u channels: %u\n", ditherBelow, ditherChannels);
+  Serial.print(buff);
+  snprintf(buff, sizeof(buff), "Power: %umA budget: %umA peak: %umA throttled: %u\n",
+           powerLastMa, powerBudgetMa, rgbTelemetry.powerPeakMa, rgbTelemetry.powerThrottled);
+  Serial.print(buff);
+  snprintf(buff, sizeof(buff), "Brightness: %u level: %u /OE: %u scale: %u ramp: %ums\n",
+           255 - pwm_oe, brightnessLevel, oeLevel, frameScale, brightnessRampMs);
+  Serial.print(buff);
+
+  for (uint8_t i = 0; i < CURVE_COUNT; i++)
+    if (curveLut == pgm_read_ptr(&curveLuts[i]))
+      Serial << F("Output curve: ") << FPSTR((const char *)pgm_read_ptr(&curveNames[i])) << endl;
+
+  for (uint8_t b = 0; b < CALIB_BATCHES; b++)
+  {
+    Serial << F("Calib[") << b << F("]: kind ") << calib[b].kind << F(" m");
+    for (uint8_t k = 0; k < 9; k++)
+      Serial << ' ' << calib[b].m[k];
+    Serial << F(" max ") << calib[b].max[0] << ' ' << calib[b].max[1] << ' ' << calib[b].max[2] << endl;
+  }
+
+  snprintf(buff, sizeof(buff), "IIC LEDn transactions: %u bytes: %u\n", iicTransactions, iicBytes);
+  Serial.print(buff);
+
+  snprintf(buff, sizeof(buff), "IIC queue full, frames dropped: %u\n", iicFramesDropped);
+  Serial.print(buff);
+
+  snprintf(buff, sizeof(buff), "IIC clock: %ukHz errors: %u\n", iicFreq, rgbTelemetry.iicErrors);
+  Serial.print(buff);
+
+  for (uint8_t i = 0; i < numStrips; i++)
+  {
+    snprintf(buff, sizeof(buff), "strip[%u]: %u %u %u\n", i, strip.h[i], strip.s[i], strip.v[i]);
+    Serial.print(buff);
+  }
+
+  for (uint8_t i = 0; i < numStrips; i++)
+  {
+    snprintf(buff, sizeof(buff), "hsvDelta[%u]: %d %d %d\n", i, hsvDelta.h[i], hsvDelta.s[i], hsvDelta.v[i]);
+    Serial.print(buff);
+  }
+
+  for (uint8_t i = 0; i < numStrips; i++)
+  {
+    snprintf(buff, sizeof(buff), "pca_rgb.rgb[%u]: %u %u %u\n", i, pca_rgb.rgb[i].r, pca_rgb.rgb[i].g, pca_rgb.rgb[i].b);
+    Serial.print(buff);
+  }
+
+  Serial.println(F("----------"));
+} // dump_structures
+
+#if 1 // dummy, allOff, allOn color cycles
+/*---------------------------------------------------------------------
+  dummy
+  
+  Some cycle m odes do not need a init or step function that does
+  something useful.
+---------------------------------------------------------------------*/
+void dummy_Init(void) {}
+void dummy_Step(uint32_t dtUs) {}
+
+/*---------------------------------------------------------------------
+  allOff
+  
+  Turn off all led strips
+---------------------------------------------------------------------*/
+void allOff_Init(void)
+{
+  // set RGB values to 0 here or better use the PCA native ALL_OFF flags?
+  // Will result in black color :-)
+
+  uni_Init(0, 0, 0);
+}
+
+void allOff_Step(uint32_t dtUs) {}
+
+/*---------------------------------------------------------------------
+  allOn
+  
+  Turn on all led strips
+---------------------------------------------------------------------*/
+void allOn_Init(void)
+{
+  // set RGB values to FRAME_MAX here or better use the PCA native ALL_ON flags?
+  // Will result in white color :-)
+
+  uni_Init(FRAME_MAX, FRAME_MAX, FRAME_MAX);
+}
+
+void allOn_Step(uint32_t dtUs) {}
+#endif
+
+#if 1 // uni colour cycle
+/*---------------------------------------------------------------------
+  Uni colour cycle
+
+  Set all colours on all strips to identical RGB colour
+---------------------------------------------------------------------*/
+void uni_Init(uint16_t r, uint16_t g, uint16_t b)
+{
+  // Set RGB value directly
+  for (uint8_t i = 0; i < numStrips; i++)
+  {
+    pca_rgb.rgb[i].r = r;
+    pca_rgb.rgb[i].g = g;
+    pca_rgb.rgb[i].b = b;
+  }
+  frameDirty = true;
+} // uni_Init
+
+void red_Init(void)
+{
+  uni_Init(FRAME_MAX, 0, 0);
+}
+
+void green_Init(void)
+{
+  uni_Init(0, FRAME_MAX, 0);
+}
+
+void blue_Init(void)
+{
+  uni_Init(0, 0, FRAME_MAX);
+}
+#endif
+
+#if 1 // debug colour cycle
+/*---------------------------------------------------------------------
+  Debug colour cycle
+
+  Cycle through all colours on all strips synchronously
+---------------------------------------------------------------------*/
+void debug_Init(void)
+{
+  uni_Init(0, 0, 0);
+
+  //  uint8_t strip = 0;
+  //  uint8_t color = 0;
+} // debug_Init
+
+void debug_Step(uint32_t dtUs)
+{
+
+  // Clear current strips color
+  switch (deb_color)
+  {
+  case 0:
+    pca_rgb.rgb[deb_strip].r = 0;
+    break;
+  case 1:
+    pca_rgb.rgb[deb_strip].g = 0;
+    break;
+  case 2:
+    pca_rgb.rgb[deb_strip].b = 0;
+    break;
+  default:
+    break;
+  }
+
+  // Calculate new strip and color
+  deb_color++;
+  if (deb_color > 2)
+  {
+    deb_color = 0;
+    deb_strip++;
+  }
+
+  if (deb_strip >= numStrips)
+    deb_strip = 0;
+
+  // Set new color on strip
+  switch (deb_color)
+  {
+  case 0:
+    pca_rgb.rgb[deb_strip].r = FRAME_MAX;
+    break;
+  case 1:
+    pca_rgb.rgb[deb_strip].g = FRAME_MAX;
+    break;
+  case 2:
+    pca_rgb.rgb[deb_strip].b = FRAME_MAX;
+    break;
+  default:
+    break;
+  }
+  frameDirty = true;
+
+} // debug_Step
+#endif
+
+#if 1 // keyframe timeline
+/*---------------------------------------------------------------------
+  Keyframe timeline
+
+  Play the timeline file from LittleFS, see timeline.h
+  Dark if there is no valid file
+---------------------------------------------------------------------*/
+void timeline_Init(void)
+{
+  uni_Init(0, 0, 0);
+
+  if (timeline::open(timeline::timelineFile))
+    timeline::render(0, pca_rgb.a, numStrips);
+} // timeline_Init
+
+void timeline_Step(uint32_t dtUs)
+{
+  // Only true if a colour changed, holds let the panel go idle
+  if (timeline::render(dtUs, pca_rgb.a, numStrips))
+    frameDirty = true;
+} // timeline_Step
+#endif
+
+#if 1 // wave colour cycle
+/*---------------------------------------------------------------------
+  Wave colour cycle
+  
+---------------------------------------------------------------------*/
+const uint16_t WAVE_HUE_OFFSET = 655; // ~0.01 of the colour wheel between strips
+
+void wave_Init(void)
+{
+  wavePhase = 0;
+  wave_Step(0);
+} // wave_Init
+
+void wave_Step(uint32_t dtUs)
+{
+  // Hue wraps around by itself
+  wavePhase += ((uint64_t)hueRateQ16 * dtUs) >> 16;
+
+  // Hue only, leaves strip to cloud which may run on another layer
+  for (uint8_t i = 0; i < numStrips; i++)
+  {
+    hsv2pcaFixed((wavePhase >> 16) + i * WAVE_HUE_OFFSET, 65535, 65535,
+                 &pca_rgb.rgb[i].r, &pca_rgb.rgb[i].g, &pca_rgb.rgb[i].b);
+  }
+  frameDirty = true;
+} // wave_Step
+#endif
+
+#if 1 // uniform colour cycle
+/*---------------------------------------------------------------------
+  uniform colour cycle
+
+  Cycle through all colours on all strips synchronously
+---------------------------------------------------------------------*/
+void uniform_Init(void)
+{
+  uniformPhase = 0;
+} // uniform_Init
+
+void uniform_Step(uint32_t dtUs)
+{
+  uint16_t r, g, b;
+
+  // Advance in color, hue wraps around by itself
+  uniformPhase += ((uint64_t)hueRateQ16 * dtUs) >> 16;
+
+  // Calculate RGB and populate all strips
+  hsv2pcaFixed(uniformPhase >> 16, 65535, 65535, &r, &g, &b);
+  uni_Init(r, g, b);
+} // uniform_Step
+#endif
+
+#if 1 // cloud colour cycle
+/*---------------------------------------------------------------------
+  Cloud colour cycle
+
+  Pick two random colours for first (s0) and last (sn) strip
+  Interpolate linearly each strip in between
+  Pick two more random colours for first and last strip
+  Fade to the new colours across all strips in random steps
+
+  State machine
+    cloudRetarget  pick new targets, go to cloudFading
+    cloudFading    fade towards the targets for cloudFadeMs, go to cloudHolding
+    cloudHolding   wait cloudHoldMs without blocking, go to cloudRetarget
+
+  Each fade picks its colour space from cloudFade when it starts. In
+  OKLab the strips go from their hue to the target hue along a straight
+  line in OKLab. Either way the colours follow the time elapsed in
+  the fade, not the frames, and the fade ends on the target hue
+  exactly, whatever the frame rate.
+---------------------------------------------------------------------*/
+enum cloudState_t
+{
+  cloudRetarget = 0,
+  cloudFading = 1,
+  cloudHolding = 2
+};
+
+cloudState_t cloudState = cloudRetarget;
+uint32_t cloudHoldStartMs = 0;
+
+uint8_t cloudFadeNow = fadeHsv;   // fade_t of the running fade
+lab_soa_st cloudLabFrom;          // OKLab fade: start colour
+lab_soa_st cloudLabDiff;          //   target minus start
+uint16_t cloudHueTo[MAX_STRIPS];  // Target hue, hsvDelta.h from the start hue
+
+// Static DRAM of the engine's buffers, sized by MAX_STRIPS,
+// PCA_MAX_CHIPS and MAX_LAYERS. The ESP8266 shares its ~80k of DRAM
+// with WiFi, web and MQTT, catch growth here.
+const size_t RGB_BUFFER_BUDGET = 12 * 1024;
+static_assert(sizeof(strip) + sizeof(hsvDelta) + sizeof(pca_rgb) + sizeof(pca_out) + sizeof(ditherErr) +
+                      sizeof(calib) + sizeof(pcaShadow) + sizeof(pcaPower) + sizeof(stripMap) + sizeof(pcaPlan) +
+                      sizeof(iicQueue) + sizeof(iicSegments) + sizeof(outFrame) + sizeof(outHist) +
+                      sizeof(layers) + sizeof(layerOut) + sizeof(cloudLabFrom) + sizeof(cloudLabDiff) +
+                      sizeof(cloudHueTo) + sizeof(rgbTopology) <=
+                  RGB_BUFFER_BUDGET,
+              "RGB buffers exceed their DRAM budget");
+
+void cloud_Init(void)
+{
+  // Initialize first and last strip
+  // Interpolate each strip in between
+  // Prepare for first ReInit
+
+  if (effectLog)
+    Serial.println(F("cloud_init..."));
+
+  uint16_t s0, sn;
+
+  // Start with all strips on the same colour
+  s0 = 0;
+  sn = 0;
+
+  // Interval between first and last strip, the short way round
+  int16_t sd = (int16_t)(sn - s0);
+  uint8_t last = numStrips > 1 ? numStrips - 1 : 1;
+
+#if 1
+  if (effectLog)
+    DBG_INIT(40)
+  "Initial s0=%u sn=%u, sd=%d", s0, sn, sd DBG_DONE
+#endif
+
+      // Initialize strips
+      for (uint8_t i = 0; i < numStrips; i++)
+  {
+    strip.h[i] = s0 + (int32_t)sd * i / last;
+    strip.s[i] = 65535;
+    strip.v[i] = 65535;
+
+#if 1
+    if (effectLog)
+      DBG_INIT(24)
+    "strip[%d] = %u", i, strip.h[i] DBG_DONE
+#endif
+
+                             hsv2pcaFixed(strip.h[i], strip.s[i], strip.v[i], &pca_rgb.rgb[i].r, &pca_rgb.rgb[i].g, &pca_rgb.rgb[i].b);
+  }
+
+  frameDirty = true;
+  cloudFadeUs = 0;
+  cloudState = cloudRetarget;
+  if (effectLog)
+    Serial << F("cloud_init...done") << endl;
+} // cloud_init
+
+void cloud_Step(uint32_t dtUs)
+{
+
+#if 0
+    DBG_INIT(24)
+    "cloud_step[%u|%u]...", cloudFadeUs, cloudFadeLenUs
+    DBG_DONE
+#endif
+
+  switch (cloudState)
+  {
+  case cloudRetarget:
+    cloud_ReInit();
+    cloudState = cloudFading;
+    break;
+
+  case cloudFading:
+  {
+    // Fraction of the fade done after this frame, Q15
+    cloudFadeUs = min(cloudFadeUs + dtUs, cloudFadeLenUs);
+    bool done = (cloudFadeUs == cloudFadeLenUs);
+    int32_t f = ((uint64_t)cloudFadeUs << 15) / cloudFadeLenUs;
+
+    if (cloudFadeNow == fadeOklab && !done)
+    {
+      for (uint8_t i = 0; i < numStrips; i++)
+      {
+        oklab2pca(cloudLabFrom.L[i] + ((cloudLabDiff.L[i] * f) >> 15),
+                  cloudLabFrom.a[i] + ((cloudLabDiff.a[i] * f) >> 15),
+                  cloudLabFrom.b[i] + ((cloudLabDiff.b[i] * f) >> 15),
+                  &pca_rgb.rgb[i].r, &pca_rgb.rgb[i].g, &pca_rgb.rgb[i].b);
+      }
+    }
+    else
+    {
+      // Hue at the fraction f of the way from the start hue
+      // Over- and underrun of hue is handled by uint16_t wrap around
+      // The end of the fade lands on the target hue
+      for (uint8_t i = 0; i < numStrips; i++)
+      {
+        if (cloudFadeNow == fadeOklab || done)
+          strip.h[i] = cloudHueTo[i];
+        else
+          strip.h[i] = cloudHueTo[i] - hsvDelta.h[i] + (((int32_t)hsvDelta.h[i] * f) >> 15);
+
+        // Calculate RGB
+        hsv2pcaFixed(strip.h[i], strip.s[i], strip.v[i],
+                     &pca_rgb.rgb[i].r, &pca_rgb.rgb[i].g, &pca_rgb.rgb[i].b);
+      }
+    }
+
+    frameDirty = true;
+
+    if (done)
+    {
+      cloudHoldStartMs = millis();
+      cloudState = cloudHolding;
+    }
+    break;
+  }
+
+  case cloudHolding:
+    // Colours are unchanged, so is the panel. Just watch the clock.
+    if (millis() - cloudHoldStartMs >= cloudHoldMs)
+      cloudState = cloudRetarget;
+    break;
+  }
+
+  return;
+} // cloud_step
+
+void cloud_ReInit(void)
+{
+  if (effectLog)
+    Serial << F("cloud_ReInit...") << millis() << endl;
+
+  uint16_t s0, sn;
+
+  // Calculate new targets
+  // Make distance large enough. One color has ~ 65536/6 = 10923
+  // Make distance not too large so it spreads nice across all strips
+  // 25% .. 75% of the colour wheel in either direction
+  s0 = random(65536);
+  sn = s0 + random(16384, 49152) * ((random(0, 2) == 0) ? 1 : -1);
+
+  // Calculate interval between first and last strip
+  // Casting the wrapped difference takes the shorter way in color circle
+  int16_t sd = (int16_t)(sn - s0);
+  uint8_t last = numStrips > 1 ? numStrips - 1 : 1;
+
+#if 1
+  if (effectLog)
+    Serial << F("New s0=") << s0 << F(" sn=") << sn << F(" sd=") << sd << '\n';
+#endif
+
+  // The fade takes cloudFadeMs, however many frames that is
+  cloudFadeUs = 0;
+  cloudFadeLenUs = cloudFadeMs * 1000UL;
+  cloudFadeNow = cloudFade;
+
+#if 1
+  if (effectLog)
+    DBG_INIT(24)
+  "cloudFadeMs=%u", cloudFadeMs
+                          DBG_DONE
+#endif
+
+      // Next cycle goes from strip.h[i] to s0 + sd * i / last in cloudFadeMs
+      for (uint8_t i = 0; i < numStrips; i++)
+  {
+    uint16_t to = s0 + (int32_t)sd * i / last;
+
+    // Whole way, the short way round
+    hsvDelta.h[i] = (int16_t)(to - strip.h[i]);
+    hsvDelta.s[i] = 0;
+    hsvDelta.v[i] = 0;
+
+    if (cloudFadeNow == fadeOklab)
+    {
+      uint16_t r, g, b;
+      int16_t L, A, B;
+
+      hsv2rgbFixed(strip.h[i], strip.s[i], strip.v[i], &r, &g, &b);
+      rgb2oklab(r, g, b, &cloudLabFrom.L[i], &cloudLabFrom.a[i], &cloudLabFrom.b[i]);
+      hsv2rgbFixed(to, strip.s[i], strip.v[i], &r, &g, &b);
+      rgb2oklab(r, g, b, &L, &A, &B);
+
+      cloudLabDiff.L[i] = L - cloudLabFrom.L[i];
+      cloudLabDiff.a[i] = A - cloudLabFrom.a[i];
+      cloudLabDiff.b[i] = B - cloudLabFrom.b[i];
+    }
+    cloudHueTo[i] = to;
+
+#if 1
+    if (effectLog)
+      Serial << F("strip[") << i << F("]=") << strip.h[i]
+             << F(" to=") << to
+             << F(" diff=") << hsvDelta.h[i] << '\n';
+#endif
+  }
+  if (effectLog)
+    Serial.println(F("cloud_ReInit...done"));
+} // cloud_ReInit
+#endif
+
+#if 1 // Panel related routines
+/**********************************************************************
+  Panel related functions
+**********************************************************************/
+
+/*---------------------------------------------------------------------
+  updatePanel
+  
+  Write colour arrays to the panel for display
+  Follows the precomputed write plan, one pass per PCA
+---------------------------------------------------------------------*/
+void updatePanel(void)
+{
+
+  //  dump_structures();
+  //  return;
+
+  uint32_t firstUs = 0, lastUs = 0;
+  uint8_t touched = 0; // PCAs written to in this frame
+  uint64_t chips = 0;  // Bit c: pcaPlan[c] written to
+  uint32_t t = iicTransactions;
+
+  // Output stage hit a bus error, unknown which PCA failed
+  if (outFailed)
+  {
+    for (uint8_t c = 0; c < pcaChips; c++)
+      pcaShadow[c].valid = false;
+    outFailed = false;
+  }
+
+  ditherFrame();
+  limitPower();
+
+  // Dithered channels change on their own in the next frames
+  frameDirty = (ditherChannels != 0);
+
+  // Wake PCAs before their channels go on
+  updatePcaPower(true);
+  idleFrames = 0;
+
+  // One broadcast transaction if all strips show the same colour
+  if (updatePanelBroadcast())
+  {
+    if (iicTransactions != t)
+    {
+      touched = pcaChips; // All latch on the same STOP
+      chips = ~(uint64_t)0;
+    }
+  }
+  else
+  {
+    uint16_t vals[PCA_CHANNELS];
+
+    for (uint8_t c = 0; c < pcaChips; c++)
+    {
+      const pca_plan_st *plan = &pcaPlan[c];
+
+      // Dark anyway, updatePcaPower wakes it when needed
+      if (pcaPower[c].state == pcaAsleep)
+        continue;
+
+      for (uint8_t ch = 0; ch < plan->count; ch++)
+        vals[ch] = (plan->src[ch] == PCA_UNUSED) ? 0 : pca_out.a[plan->src[ch]];
+
+      t = iicTransactions;
+      pca_rgb_update(vals, phaseStagger ? plan->phase : nullptr, plan->addr, plan->count, &pcaShadow[c]);
+      if (iicTransactions != t)
+      {
+        lastUs = micros();
+        if (!touched++)
+          firstUs = lastUs;
+        chips |= (uint64_t)1 << c;
+      }
+    }
+  }
+
+  if (iicQueueFull)
+  {
+    // Sending part of the frame would break the single STOP, drop it.
+    // The next frame rewrites all PCAs, one block write per PCA always
+    // fits the queue.
+    iicQueueLen = 0;
+    iicSegmentCount = 0;
+    iicQueueFull = false;
+    iicFramesDropped++;
+    for (uint8_t c = 0; c < pcaChips; c++)
+      pcaShadow[c].valid = false;
+    frameDirty = true;
+    return;
+  }
+
+  if (timedOutput)
+  {
+    // Prepare the frame, outputTick sends it with one STOP and records
+    // its bus time
+    outFramePush();
+    outFrameTouched = touched;
+    outFrameChips = chips;
+    return;
+  }
+
+  if (iicSegmentCount)
+  {
+    // Synchronized output: send everything queued above with one STOP,
+    // all PCAs latch on it
+    uint32_t startUs = micros();
+    if (!pca_flush_queue())
+    {
+      // Unknown which PCA failed
+      for (uint8_t c = 0; c < pcaChips; c++)
+        pcaShadow[c].valid = false;
+    }
+    recordTx(micros() - startUs);
+    firstUs = lastUs = 0;
+  }
+
+  if (touched > 1)
+    recordSkew(lastUs - firstUs);
+
+  applyOe(oeLevel);
+}
+
+/*---------------------------------------------------------------------
+  recordSkew
+  
+  Add the output skew of a frame to the statistics. No Serial output,
+  also called by the output Ticker.
+---------------------------------------------------------------------*/
+void recordSkew(uint32_t us)
+{
+  skewLastUs = us;
+  skewMaxUs = max(skewMaxUs, us);
+  skewSumUs += us;
+  skewFrames++;
+} // recordSkew
+
+/*---------------------------------------------------------------------
+  recordTx
+  
+  Add the bus time of a frame sent in one transaction to the telemetry.
+  No Serial output, also called by the output Ticker.
+---------------------------------------------------------------------*/
+void recordTx(uint32_t us)
+{
+  rgbTelemetry.txLastUs = us;
+  rgbTelemetry.txMaxUs = max(rgbTelemetry.txMaxUs, us);
+} // recordTx
+
+/*---------------------------------------------------------------------
+  ditherFrame
+  
+  16 bit frame (pca_rgb) to 12 bit PCA values (pca_out)
+  
+  The output curve, if any, maps the frame to the duty first, then the
+  calibration of the strip's batch and the brightness frame scale
+  apply.
+  Channels below ditherBelow carry the lower 4 bits over to the next
+  frames (first order error diffusion), so a slow fade at low
+  brightness moves in 1/16 steps on average instead of visible 12 bit
+  steps. To keep the delta writes quiet, brighter channels, where a
+  12 bit step does not show, are truncated and stay put, and a channel
+  without a fraction never toggles. Strips showing the same colour
+  toggle in step and still go out as one broadcast.
+---------------------------------------------------------------------*/
+void ditherFrame(void)
+{
+  ditherChannels = 0;
+
+  if (!dutySumValid)
+  {
+    // Sum from scratch, the strips before were not all mapped
+    memset(pca_out.a, 0, sizeof(pca_out.a));
+    dutySum[0] = dutySum[1] = dutySum[2] = 0;
+    dutySumValid = true;
+  }
+
+  for (uint8_t i = 0; i < numStrips; i++)
+  {
+    const calib_st *cal = &calib[stripMap[i].batch];
+    int32_t v[3];
+
+    for (uint8_t c = 0; c < 3; c++)
+    {
+      v[c] = pca_rgb.a[i * 3 + c];
+      if (curveLut)
+        v[c] = pgm_read_word(&curveLut[v[c] >> 6]);
+    }
+
+    if (cal->kind == calibDiagonal)
+    {
+      for (uint8_t c = 0; c < 3; c++)
+        v[c] = constrain((v[c] * cal->m[c * 4]) >> 12, 0, (int32_t)cal->max[c]);
+    }
+    else if (cal->kind == calibMatrix)
+    {
+      // Coefficients within +-2 keep the sums within 31 bits
+      int32_t r = (cal->m[0] * v[0] + cal->m[1] * v[1] + cal->m[2] * v[2]) >> 12;
+      int32_t g = (cal->m[3] * v[0] + cal->m[4] * v[1] + cal->m[5] * v[2]) >> 12;
+      int32_t b = (cal->m[6] * v[0] + cal->m[7] * v[1] + cal->m[8] * v[2]) >> 12;
+      v[0] = constrain(r, 0, (int32_t)cal->max[0]);
+      v[1] = constrain(g, 0, (int32_t)cal->max[1]);
+      v[2] = constrain(b, 0, (int32_t)cal->max[2]);
+    }
+
+    if (frameScale != 65536)
+    {
+      for (uint8_t c = 0; c < 3; c++)
+        v[c] = ((uint32_t)v[c] * frameScale) >> 16;
+    }
+
+    for (uint8_t c = 0; c < 3; c++)
+    {
+      uint8_t k = i * 3 + c;
+      uint16_t out = v[c] >> 4;
+
+      if (out < ditherBelow)
+      {
+        // A carry adds 1, stay within 12 bits
+        uint8_t acc = (v[c] & 0x0F) + ditherErr[k];
+        out = min((uint16_t)(out + (acc >> 4)), (uint16_t)4095);
+        ditherErr[k] = acc & 0x0F;
+        if (v[c] & 0x0F)
+          ditherChannels++;
+      }
+
+      dutySum[c] += out - pca_out.a[k];
+      pca_out.a[k] = out;
+    }
+  }
+} // ditherFrame
+
+/*---------------------------------------------------------------------
+  limitPower
+  
+  Estimate the current of the frame in pca_out from the duty sums, the
+  channel current at full duty and the /OE on time the frame goes out
+  with (oeLevel, see applyOe). Three multiplies
+  per frame. Above the budget the whole frame is scaled down in one
+  pass, which keeps the colours and the sums.
+---------------------------------------------------------------------*/
+void limitPower(void)
+{
+  uint32_t ma = 0;
 
-  if (res)
-    beep(50, 50, 50, 0, 0);
-  else
-    beep(100, 50, 100, 0, 0);
+  for (uint8_t c = 0; c < 3; c++)
+    ma += dutySum[c] * channelMa[c] / 4095;
+  ma = ma * oeLevel / OE_PWM_RANGE;
 
-  return res;
-} // processSerialInput
+  powerLastMa = min(ma, (uint32_t)0xFFFF);
+  rgbTelemetry.powerPeakMa = max(rgbTelemetry.powerPeakMa, powerLastMa);
 
-void dumpHelp()
-{
-  Serial << F(
-      "0 All OFF\n"
-      "1 All ON\n"
-      "2 Red\n"
-      "3 Green\n"
-      "4 Blue\n"
-      "5 Uniform\n"
-      "6 Cloud\n"
-      "7 Wave\n"
-      "b Increase Brightness\n"
-      "B Decrease Brightness\n"
-      "s Decrease Step Delay\n"
-      "S Increase Step Delay\n"
-      "g Enable Beep\n"
-      "G Disable Beep\n"
-      "@ Software Reset\n"
-      "e Dump EEPROM\n"
-      "E Reinit EEPROM\n"
-      "? This help\n");
-} // dumpHelp
+  if (!powerBudgetMa || ma <= powerBudgetMa)
+    return;
+
+  // Q16, below 1.0
+  uint32_t scale = ((uint32_t)powerBudgetMa << 16) / ma;
+
+  dutySum[0] = dutySum[1] = dutySum[2] = 0;
+  for (uint8_t k = 0; k < numStrips * 3; k++)
+  {
+    pca_out.a[k] = (pca_out.a[k] * scale) >> 16;
+    dutySum[k % 3] += pca_out.a[k];
+  }
+
+  rgbTelemetry.powerThrottled++;
+} // limitPower
 
 /*---------------------------------------------------------------------
-  setCycleMode
+  updatePanelBroadcast
   
-  Sets one of the allowed cycle modes
-  Ignores setting if cycle already in progress
+  Uniform frames (all strips the same colour) are sent once to the
+  ALL_CALL address instead of once per PCA.
+  Grey levels (incl. off and white) only need the ALL_LED registers.
+  Other colours need a LEDn block write, which requires an identical
+  channel layout on all PCAs.
+  Both give every channel the same phase. With staggered phases only
+  the dark frame, which has no edges at all, is broadcast.
+  ALL_CALL reaches every channel of every PCA on the bus, so neither
+  is used unless the plan covers all of them.
 
   Returns
-    0 invalid cycle mode
-    1 cycle mode set
+    false if the frame is not uniform or can not be broadcast
 ---------------------------------------------------------------------*/
-uint8_t setCycleMode(cycleMode_t cm)
+bool updatePanelBroadcast(void)
 {
-  switch (cm)
+  // Sleeping PCAs are left alone
+  if (!pcaChips || pcaSleeping || !pcaBroadcast.full || !pcaBusExclusive)
+    return false;
+
+  rgb_st c = pca_out.rgb[0];
+  for (uint8_t i = 1; i < numStrips; i++)
   {
-  case allOff:
-    init_func = &allOff_Init;
-    step_func = &allOff_Step;
-    Serial.println(F("allOff"));
-    break;
-  case allOn:
-    init_func = &allOn_Init;
-    step_func = &allOn_Step;
-    Serial.println(F("allOn"));
-    break;
-  case red:
-    init_func = &red_Init;
-    step_func = &dummy_Step;
-    Serial.println(F("red"));
-    break;
-  case green:
-    init_func = &green_Init;
-    step_func = &dummy_Step;
-    Serial.println(F("green"));
-    break;
-  case blue:
-    init_func = &blue_Init;
-    step_func = &dummy_Step;
-    Serial.println(F("blue"));
-    break;
-  case uniform:
-    init_func = &uniform_Init;
-    step_func = &uniform_Step;
-    Serial.println(F("uniform"));
-    break;
-  case cloud:
-    init_func = &cloud_Init;
-    step_func = &cloud_Step;
-    Serial.println(F("cloud"));
-    break;
-  case wave:
-    init_func = &wave_Init;
-    step_func = &wave_Step;
-    Serial.println(F("wave"));
-    break;
-    //  case '8': break;
-    //  case '9': break;
-  case debug:
-    init_func = &debug_Init;
-    step_func = &debug_Step;
-    Serial.println(F("debug"));
-    break;
-  default:
-    Serial << F("Cycle mode not implemented: ") << cycleMode << ".\n";
-    newCycleModeSelected = false;
-    return 0;
-    break;
+    if (pca_out.rgb[i].r != c.r || pca_out.rgb[i].g != c.g || pca_out.rgb[i].b != c.b)
+      return false;
   }
 
-  // We have a valid new cycle mode
-  newCycleModeSelected = true; // Initialize in loop on next pass
-  cycleMode = cm;              // Store new cycle mode
+  if (phaseStagger && (c.r || c.g || c.b))
+    return false;
 
-  // Persist new cycleMode to EEPROM
-  EEPROM.write(EEPROM_ADDR_CYCLEMODE, cycleMode);
-  EEPROM.commit();
+  uint16_t on = 0;
 
-  return 1;
-} // setCycleMode
+  if (c.r == c.g && c.g == c.b)
+  {
+    // ALL_LED: 4 bytes set every channel of every PCA
+    uint16_t off = pcaOffTime(c.r, on);
 
-void dump_structures(void)
+    bool same = true;
+    for (uint8_t k = 0; k < pcaChips && same; k++)
+    {
+      same = pcaShadow[k].valid;
+      for (uint8_t ch = 0; ch < pcaPlan[k].count && same; ch++)
+        same = (pcaShadow[k].on[ch] == on && pcaShadow[k].off[ch] == off);
+    }
+    if (same)
+      return true;
+
+    bool ok = pca_write_all_led(on, off);
+    for (uint8_t k = 0; k < pcaChips; k++)
+    {
+      for (uint8_t ch = 0; ch < PCA_CHANNELS; ch++)
+      {
+        pcaShadow[k].on[ch] = on;
+        pcaShadow[k].off[ch] = off;
+      }
+      pcaShadow[k].valid = ok;
+    }
+    return true;
+  }
+
+  if (!pcaBroadcast.usable)
+    return false;
+
+  // LEDn block write to all PCAs. Merge the shadows: a channel counts
+  // as changed if it differs on any PCA.
+  uint16_t vals[PCA_CHANNELS];
+  pca_shadow_st all = pcaShadow[0];
+
+  for (uint8_t ch = 0; ch < pcaBroadcast.count; ch++)
+  {
+    switch (pcaBroadcast.comp[ch])
+    {
+    case 0:
+      vals[ch] = c.r;
+      break;
+    case 1:
+      vals[ch] = c.g;
+      break;
+    case 2:
+      vals[ch] = c.b;
+      break;
+    default:
+      vals[ch] = 0;
+      break;
+    }
+
+    for (uint8_t k = 1; k < pcaChips; k++)
+    {
+      if (pcaShadow[k].on[ch] != all.on[ch] || pcaShadow[k].off[ch] != all.off[ch])
+        all.valid = false;
+    }
+  }
+  for (uint8_t k = 1; k < pcaChips; k++)
+    all.valid = all.valid && pcaShadow[k].valid;
+
+  pca_rgb_update(vals, nullptr, PCA_ALLCALL_ADDRESS, pcaBroadcast.count, &all);
+
+  for (uint8_t k = 0; k < pcaChips; k++)
+    pcaShadow[k] = all;
+
+  return true;
+} // updatePanelBroadcast
+
+/*---------------------------------------------------------------------
+  initPanel
+  
+  Initialize all PCA9685 ICs as required for operation
+---------------------------------------------------------------------*/
+void initPanel(void)
 {
-  char buff[64];
+  uint8_t buff[1];
+  uint8_t b = 0;
 
-  Serial.println(F("----------"));
-  snprintf(buff, sizeof(buff), "Loop Count: %u\n", loopCount);
-  Serial.print(buff);
+  // Software reset or not, the content of the chips is unknown now
+  for (uint8_t c = 0; c < PCA_MAX_CHIPS; c++)
+    pcaShadow[c].valid = false;
 
-  snprintf(buff, sizeof(buff), "MaxSteps: %u CountSteps: %u\n", countMaxSteps, countSteps);
-  Serial.print(buff);
+  // A prepared frame may address PCAs of the old layout
+  outReady = false;
 
-  for (uint8_t i = 0; i < MAX_STRIPS; i++)
+  // pca_init wakes every PCA of the layout
+  memset(pcaPower, 0, sizeof(pcaPower));
+  pcaSleeping = 0;
+  if (oeGated)
   {
-    snprintf(buff, sizeof(buff), "strip[%u]: %g %g %g\n", i, strip[i].h, strip[i].s, strip[i].v);
-    Serial.print(buff);
+    oeGated = false;
+    analogWrite(PWM_OE_PIN, OE_PWM_RANGE - oeOut);
   }
 
-  for (uint8_t i = 0; i < MAX_STRIPS; i++)
+  panelInitialized = true;
+
+  // Stubbed there is no bus, nothing outside the plan
+  pcaBusExclusive = stubPCA;
+
+  if (stubPCA)
   {
-    snprintf(buff, sizeof(buff), "hsvDelta[%u]: %g %g %g\n", i, hsvDelta[i].h, hsvDelta[i].s, hsvDelta[i].v);
-    Serial.print(buff);
+    Serial << F("WARNING: initPanel: PCA is stubbed.") << endl;
+    return;
   }
 
-  for (uint8_t i = 0; i < MAX_STRIPS; i++)
+  // Reset IIC bus
+  Serial << F("initPanel: Reset IIC.") << endl;
+  //  iic.start(0x00 | I2C_WRITE);
+  //  iic.write(0x06);
+  //  iic.stop();
+
+  buff[b++] = 0x06;
+
+  brzo_i2c_start_transaction(0x00, iicFreq);
+  brzo_i2c_write(buff, b, false);
+  uint8_t res = brzo_i2c_end_transaction();
+  Serial << F("initPanel: IIC Status: ") << res << endl;
+
+  for (uint8_t c = 0; c < pcaChips; c++)
   {
-    snprintf(buff, sizeof(buff), "pca_rgb.rgb[%u]: %u %u %u\n", i, pca_rgb.rgb[i].r, pca_rgb.rgb[i].g, pca_rgb.rgb[i].b);
-    Serial.print(buff);
+    // Init PCAs to default values
+    //    Serial << F("initPanel: init PCA9685 at ") << _HEX(addr) << ':' << addr << '\n';
+    pca_init(pcaPlan[c].addr);
   }
 
-  Serial.println(F("----------"));
-} // dump_structures
+  // ALL_CALL reaches PCAs outside the topology too, broadcast only
+  // if there are none
+  bool exclusive = true;
+  for (uint8_t addr = PCA_BASE_ADDRESS; addr <= 0x7F; addr++)
+  {
+    bool known = (addr == PCA_ALLCALL_ADDRESS);
+    for (uint8_t c = 0; c < pcaChips && !known; c++)
+      known = (pcaPlan[c].addr == addr);
 
-#if 1 // dummy, allOff, allOn color cycles
-/*---------------------------------------------------------------------
-  dummy
-  
-  Some cycle m odes do not need a init or step function that does
-  something useful.
----------------------------------------------------------------------*/
-void dummy_Init(void) {}
-void dummy_Step(void) {}
+    if (!known && pca_probe(addr))
+    {
+      Serial << F("initPanel: PCA ") << _HEX(addr) << F(" not in topology, no broadcast") << endl;
+      exclusive = false;
+    }
+  }
+  pcaBusExclusive = exclusive;
+} // initPanel
 
 /*---------------------------------------------------------------------
-  allOff
+  updatePcaPower
   
-  Turn off all led strips
+  Put blank PCAs to sleep and wake them as soon as one of their
+  channels is needed. frame: called by updatePanel with a new pca_out.
+  Without a frame only the timers and the brightness are looked at, so
+  this is cheap enough for every loop.
+  
+  Sleep: all channels full off via ALL_LED_OFF, then MODE1 SLEEP. Not
+  while the prepared frame still writes to the PCA, it must not reach
+  a sleeping one.
+  Wake: MODE1 with SLEEP cleared, after PCA_WAKE_US for the oscillator
+  MODE1 RESTART. The LEDn registers are rewritten by the next frame.
+  The PCA is not waited for, its frame goes out while it wakes.
 ---------------------------------------------------------------------*/
-void allOff_Init(void)
+void updatePcaPower(bool frame)
 {
-  // set RGB values to 0 here or better use the PCA native ALL_OFF flags?
-  // Will result in black color :-)
+  bool dark = (brightnessLevel == 0);
 
-  uni_Init(0, 0, 0);
-}
+  for (uint8_t c = 0; c < pcaChips; c++)
+  {
+    pca_power_st *p = &pcaPower[c];
+    const pca_plan_st *plan = &pcaPlan[c];
+
+    if (frame)
+    {
+      bool blank = true;
+      for (uint8_t ch = 0; ch < plan->count && blank; ch++)
+        blank = (plan->src[ch] == PCA_UNUSED || !pca_out.a[plan->src[ch]]);
+
+      if (blank && !p->blank)
+        p->since = millis();
+      p->blank = blank;
+    }
+
+    switch (p->state)
+    {
+    case pcaAwake:
+      if ((p->blank || dark) && pcaShadow[c].valid && !(outReady && (outFrameChips >> c & 1)) && !outFailed &&
+          millis() - p->since >= PCA_SLEEP_AFTER_MS)
+      {
+        const uint8_t fullOff[] = {0x00, 0x10};
+        const uint8_t sleep = 0x31; // AI, SLEEP, ALLCALL
+
+        // Rewrite all channels after waking up
+        pcaShadow[c].valid = false;
+        if (pca_write_regs(plan->addr, 0xFC, fullOff, 2) && pca_write_regs(plan->addr, 0x00, &sleep, 1))
+        {
+          p->state = pcaAsleep;
+          pcaSleeping++;
+        }
+      }
+      break;
+
+    case pcaAsleep:
+      if (!p->blank && !dark)
+      {
+        const uint8_t wake = 0x21; // AI, ALLCALL
+
+        if (pca_write_regs(plan->addr, 0x00, &wake, 1))
+        {
+          p->state = pcaWaking;
+          p->since = micros();
+          frameDirty = true;
+        }
+      }
+      break;
+
+    case pcaWaking:
+      if (micros() - p->since >= PCA_WAKE_US)
+      {
+        const uint8_t restart = 0xA1; // RESTART, AI, ALLCALL
+
+        // The LEDn writes of the frame may have cleared RESTART already,
+        // then writing it has no effect
+        pca_write_regs(plan->addr, 0x00, &restart, 1);
+        p->state = pcaAwake;
+        p->since = millis();
+        pcaSleeping--;
+      }
+      break;
+    }
+  }
+
+  // /OE off while all PCAs sleep, saves the PWM interrupts too
+  bool gate = pcaChips && pcaSleeping == pcaChips;
+  for (uint8_t c = 0; c < pcaChips && gate; c++)
+    gate = (pcaPower[c].state == pcaAsleep);
 
-void allOff_Step(void) {}
+  if (gate != oeGated)
+  {
+    oeGated = gate;
+    analogWrite(PWM_OE_PIN, gate ? OE_PWM_RANGE : OE_PWM_RANGE - oeOut);
+  }
+} // updatePcaPower
 
 /*---------------------------------------------------------------------
-  allOn
+  qualifyBus
   
-  Turn on all led strips
+  Step up the IIC clock up to maxFreq kHz. At each step every PCA must
+  read back a number of test patterns without error. Settles on the
+  fastest step before the first failing one. Error counts per step end
+  up in rgbTelemetry.
+  Without a PCA to test (stubbed or none in the plan) nothing is
+  qualified, the bus stays at the baseline of the first step.
+  
+  Returns
+    the chosen frequency in kHz
 ---------------------------------------------------------------------*/
-void allOn_Init(void)
+uint16_t qualifyBus(uint16_t maxFreq)
 {
-  // set RGB values to 4095 here or better use the PCA native ALL_ON flags?
-  // Will result in white color :-)
+  uint16_t chosen = iicFreqSteps[0];
+  bool failed = false;
 
-  uni_Init(4095, 4095, 4095);
-}
+  for (uint8_t i = 0; i < IIC_FREQ_STEPS; i++)
+  {
+    rgbTelemetry.iicQualErrors[i] = IIC_NOT_QUALIFIED;
 
-void allOn_Step(void) {}
-#endif
+    if (failed || iicFreqSteps[i] > maxFreq || stubPCA || !pcaChips)
+      continue;
 
-#if 1 // uni colour cycle
-/*---------------------------------------------------------------------
-  Uni colour cycle
+    uint16_t errors = 0;
+    for (uint8_t c = 0; c < pcaChips; c++)
+      errors += pca_verify(pcaPlan[c].addr, iicFreqSteps[i]);
+    rgbTelemetry.iicQualErrors[i] = errors;
 
-  Set all colours on all strips to identical RGB colour
----------------------------------------------------------------------*/
-void uni_Init(uint16_t r, uint16_t g, uint16_t b)
-{
-  // Set RGB value directly
-  for (uint8_t i = 0; i < MAX_STRIPS; i++)
-  {
-    pca_rgb.rgb[i].r = r;
-    pca_rgb.rgb[i].g = g;
-    pca_rgb.rgb[i].b = b;
-  }
-} // uni_Init
+    Serial << F("qualifyBus: ") << iicFreqSteps[i] << F("kHz errors: ") << errors << endl;
 
-void red_Init(void)
-{
-  uni_Init(4095, 0, 0);
-}
+    if (errors)
+      failed = true;
+    else
+      chosen = iicFreqSteps[i];
+  }
 
-void green_Init(void)
-{
-  uni_Init(0, 4095, 0);
-}
+  iicFreq = chosen;
+  rgbTelemetry.iicFreq = iicFreq;
+  Serial << F("qualifyBus: using ") << iicFreq << F("kHz") << endl;
 
-void blue_Init(void)
-{
-  uni_Init(0, 0, 4095);
-}
-#endif
+  return iicFreq;
+} // qualifyBus
 
-#if 1 // debug colour cycle
 /*---------------------------------------------------------------------
-  Debug colour cycle
+  parseTopology
+  
+  Parse a topology string into a strip map.
+  One entry per strip, separated by blanks, ',' or ';'
+    <addr>:<r>/<g>/<b>  IIC address (7 bit, hex) and R, G, B channel
+    <addr>:<r>          Short form for <addr>:<r>/<r+1>/<r+2>
+    either one followed by @<n> puts the strip in calibration batch n
+  e.g. "40:0 40:3 40:6 40:9 40:12 41:0/1/2@1"
 
-  Cycle through all colours on all strips synchronously
+  Returns
+    false on syntax error or values out of range
 ---------------------------------------------------------------------*/
-void debug_Init(void)
+bool parseTopology(const char *str, strip_map_st *map, uint8_t *strips)
 {
-  uni_Init(0, 0, 0);
+  uint8_t n = 0;
+  const char *p = str;
+  char *end;
 
-  //  uint8_t strip = 0;
-  //  uint8_t color = 0;
-} // debug_Init
+  while (*p)
+  {
+    if (*p == ' ' || *p == ',' || *p == ';' || *p == '\t')
+    {
+      p++;
+      continue;
+    }
 
-void debug_Step(void)
-{
+    if (n >= MAX_STRIPS)
+    {
+      Serial << F("parseTopology: more than ") << MAX_STRIPS << F(" strips") << endl;
+      return false;
+    }
 
-  // Clear current strips color
-  switch (deb_color)
-  {
-  case 0:
-    pca_rgb.rgb[deb_strip].r = 0;
-    break;
-  case 1:
-    pca_rgb.rgb[deb_strip].g = 0;
-    break;
-  case 2:
-    pca_rgb.rgb[deb_strip].b = 0;
-    break;
-  default:
-    break;
-  }
+    uint32_t addr = strtoul(p, &end, 16);
+    if (end == p || *end != ':' || addr < PCA_BASE_ADDRESS || addr > 0x7F || addr == PCA_ALLCALL_ADDRESS)
+    {
+      Serial << F("parseTopology: bad address in strip ") << n << endl;
+      return false;
+    }
+    p = end + 1;
 
-  // Calculate new strip and color
-  deb_color++;
-  if (deb_color > 2)
-  {
-    deb_color = 0;
-    deb_strip++;
-  }
+    uint32_t ch[3];
+    for (uint8_t c = 0; c < 3; c++)
+    {
+      if (c > 0 && *p != '/')
+      {
+        // Short form, consecutive channels
+        ch[c] = ch[c - 1] + 1;
+        continue;
+      }
+      if (c > 0)
+        p++;
 
-  if (deb_strip > MAX_STRIPS)
-    deb_strip = 0;
+      ch[c] = strtoul(p, &end, 10);
+      if (end == p)
+      {
+        Serial << F("parseTopology: bad channel in strip ") << n << endl;
+        return false;
+      }
+      p = end;
+    }
 
-  // Set new color on strip
-  switch (deb_color)
-  {
-  case 0:
-    pca_rgb.rgb[deb_strip].r = 4095;
-    break;
-  case 1:
-    pca_rgb.rgb[deb_strip].g = 4095;
-    break;
-  case 2:
-    pca_rgb.rgb[deb_strip].b = 4095;
-    break;
-  default:
-    break;
+    uint32_t batch = 0;
+    if (*p == '@')
+    {
+      batch = strtoul(++p, &end, 10);
+      if (end == p || batch >= CALIB_BATCHES)
+      {
+        Serial << F("parseTopology: bad batch in strip ") << n << endl;
+        return false;
+      }
+      p = end;
+    }
+
+    for (uint8_t c = 0; c < 3; c++)
+    {
+      if (ch[c] >= PCA_CHANNELS)
+      {
+        Serial << F("parseTopology: channel out of range in strip ") << n << endl;
+        return false;
+      }
+      map[n].addr[c] = addr;
+      map[n].channel[c] = ch[c];
+    }
+    map[n].batch = batch;
+    n++;
   }
 
-} // debug_Step
-#endif
+  *strips = n;
+  return (n > 0);
+} // parseTopology
 
-#if 1 // wave colour cycle
 /*---------------------------------------------------------------------
-  Wave colour cycle
+  parseCalib
   
+  Parse a calibration string into CALIB_BATCHES batches.
+  One entry per batch, batch 0 first, separated by ';'
+    <r>,<g>,<b>          Gains in 1/1000, a diagonal matrix
+    <m00>,...,<m22>      3x3 matrix in 1/1000, row major, rows are the
+                         R, G and B output
+  either one optionally followed by
+    /<r>,<g>,<b>         Max duty per channel, 12 bit
+  Values are within -2000..2000, batches not given are left as they are.
+  e.g. "1000,250,250" or "1000,250,250/4095,3000,3000;950,260,240"
+
+  Returns
+    false on syntax error or values out of range
 ---------------------------------------------------------------------*/
-void wave_Init(void)
+bool parseCalib(const char *str, calib_st *cal)
 {
-  // Initialize strips
-  for (uint8_t i = 0; i < MAX_STRIPS; i++)
+  uint8_t b = 0;
+  const char *p = str;
+  char *end;
+
+  while (*p)
   {
-    strip[i].h = ((double)i) * 0.01;
-    strip[i].s = 1;
-    strip[i].v = 1;
+    if (*p == ' ' || *p == '\t')
+    {
+      p++;
+      continue;
+    }
 
-    hsv2pca(strip[i].h, strip[i].s, strip[i].v,
-            &pca_rgb.rgb[i].r, &pca_rgb.rgb[i].g, &pca_rgb.rgb[i].b);
-  }
-} // wave_Init
+    if (b >= CALIB_BATCHES)
+    {
+      Serial << F("parseCalib: more than ") << CALIB_BATCHES << F(" batches") << endl;
+      return false;
+    }
 
-void wave_Step(void)
-{
+    int32_t v[9];
+    uint8_t n = 0;
+    while (n < 9)
+    {
+      v[n] = strtol(p, &end, 10);
+      if (end == p || v[n] < -2000 || v[n] > 2000)
+      {
+        Serial << F("parseCalib: bad value in batch ") << b << endl;
+        return false;
+      }
+      n++;
+      p = end;
+      if (*p != ',')
+        break;
+      p++;
+    }
+    if (n != 3 && n != 9)
+    {
+      Serial << F("parseCalib: need 3 or 9 values in batch ") << b << endl;
+      return false;
+    }
 
-  for (uint8_t i = 0; i < MAX_STRIPS; i++)
-  {
-    strip[i].h += 0.001;
-    while (strip[i].h > 1.0)
-      strip[i].h -= 1.0;
+    calib_st *c = &cal[b];
+    for (uint8_t k = 0; k < 9; k++)
+    {
+      int32_t pm = (n == 9) ? v[k] : ((k % 4) ? 0 : v[k / 4]);
+      c->m[k] = (pm * 4096 + (pm < 0 ? -500 : 500)) / 1000;
+    }
 
-    strip[i].s = 1;
-    strip[i].v = 1;
+    for (uint8_t k = 0; k < 3; k++)
+      c->max[k] = 0xFFFF;
+    if (*p == '/')
+    {
+      for (uint8_t k = 0; k < 3; k++)
+      {
+        uint32_t m = strtoul(++p, &end, 10);
+        if (end == p || m > 4095 || (k < 2 && *end != ','))
+        {
+          Serial << F("parseCalib: bad max in batch ") << b << endl;
+          return false;
+        }
+        c->max[k] = (m << 4) | 0x0F;
+        p = end;
+      }
+    }
 
-    hsv2pca(strip[i].h, strip[i].s, strip[i].v,
-            &pca_rgb.rgb[i].r, &pca_rgb.rgb[i].g, &pca_rgb.rgb[i].b);
+    // Cheapest way to apply it
+    bool diagonal = true;
+    bool identity = true;
+    for (uint8_t k = 0; k < 9; k++)
+    {
+      if (k % 4)
+        diagonal = diagonal && !c->m[k];
+      identity = identity && c->m[k] == ((k % 4) ? 0 : 4096);
+    }
+    for (uint8_t k = 0; k < 3; k++)
+      identity = identity && c->max[k] == 0xFFFF;
+    c->kind = identity ? calibIdentity : (diagonal ? calibDiagonal : calibMatrix);
+
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p == ';')
+      p++;
+    else if (*p)
+    {
+      Serial << F("parseCalib: unexpected '") << *p << F("' in batch ") << b << endl;
+      return false;
+    }
+    b++;
   }
-} // wave_Step
-#endif
 
-#if 1 // uniform colour cycle
-/*---------------------------------------------------------------------
-  uniform colour cycle
+  return true;
+} // parseCalib
 
-  Cycle through all colours on all strips synchronously
+/*---------------------------------------------------------------------
+  buildPanelPlan
+  
+  Precompute the per PCA write plan from a strip map.
+  Only replaces the current plan if the map is consistent, with apply
+  false it only checks the map.
+  
+  Returns
+    false if too many chips are used or a channel is assigned twice
 ---------------------------------------------------------------------*/
-void uniform_Init(void)
+bool buildPanelPlan(const strip_map_st *map, uint8_t strips, bool apply)
 {
-  for (uint8_t i = 0; i < MAX_STRIPS; i++)
+  pca_plan_st plan[PCA_MAX_CHIPS];
+  uint8_t chips = 0;
+
+  for (uint8_t i = 0; i < strips; i++)
   {
-    strip[i].h = 0;
-    strip[i].s = 1;
-    strip[i].v = 1;
+    for (uint8_t c = 0; c < 3; c++)
+    {
+      uint8_t addr = map[i].addr[c];
+      uint8_t ch = map[i].channel[c];
+
+      // Find chip or add it
+      uint8_t k = 0;
+      while (k < chips && plan[k].addr != addr)
+        k++;
+      if (k == chips)
+      {
+        if (chips == PCA_MAX_CHIPS)
+        {
+          Serial << F("buildPanelPlan: more than ") << PCA_MAX_CHIPS << F(" PCAs") << endl;
+          return false;
+        }
+        plan[k].addr = addr;
+        plan[k].count = 0;
+        memset(plan[k].src, PCA_UNUSED, sizeof(plan[k].src));
+        memset(plan[k].phase, 0, sizeof(plan[k].phase));
+        chips++;
+      }
+
+      if (plan[k].src[ch] != PCA_UNUSED)
+      {
+        Serial << F("buildPanelPlan: channel ") << ch << F(" of PCA ") << _HEX(addr) << F(" used twice") << endl;
+        return false;
+      }
+      plan[k].src[ch] = i * 3 + c;
+      plan[k].count = max(plan[k].count, (uint8_t)(ch + 1));
+
+      // Evenly spaced over the period across all PCAs, which share the
+      // supply. Colours first, so a strip's R, G and B are a third of
+      // the period apart, then the strips within each third.
+      plan[k].phase[ch] = (uint32_t)(c * strips + i) * 4096 / (strips * 3);
+    }
   }
-} // uniform_Init
 
-void uniform_Step(void)
-{
-  //  double d;
-  // Calculate next step
+  if (!apply)
+    return true;
 
-  // First strip is reference
-  // Advance in color
-  strip[0].h += 0.001;
+  memcpy(pcaPlan, plan, sizeof(plan));
+  pcaChips = chips;
 
-  while (strip[0].h > 1.0)
-    strip[0].h -= 1.0;
-  //    strip[0].h = modf(strip[0].h, &d);
+  // Can uniform frames be sent to all PCAs at once?
+  pcaBroadcast.usable = true;
+  pcaBroadcast.full = true;
+  pcaBroadcast.count = 0;
+  memset(pcaBroadcast.comp, PCA_UNUSED, sizeof(pcaBroadcast.comp));
+  for (uint8_t k = 0; k < chips; k++)
+  {
+    for (uint8_t ch = 0; ch < PCA_CHANNELS; ch++)
+    {
+      if (plan[k].src[ch] == PCA_UNUSED)
+      {
+        pcaBroadcast.full = false;
+        continue;
+      }
 
-  while (strip[0].h < 0)
-    strip[0].h += 1;
+      uint8_t comp = plan[k].src[ch] % 3;
+      if (pcaBroadcast.comp[ch] != PCA_UNUSED && pcaBroadcast.comp[ch] != comp)
+        pcaBroadcast.usable = false;
+      pcaBroadcast.comp[ch] = comp;
+    }
+    pcaBroadcast.count = max(pcaBroadcast.count, plan[k].count);
+  }
 
-  // Calculate RGB
-  hsv2pca(strip[0].h, strip[0].s, strip[0].v,
-          &pca_rgb.rgb[0].r, &pca_rgb.rgb[0].g, &pca_rgb.rgb[0].b);
+  for (uint8_t c = 0; c < PCA_MAX_CHIPS; c++)
+    pcaShadow[c].valid = false;
 
-  // Populate RGB
-  uni_Init(pca_rgb.rgb[0].r, pca_rgb.rgb[0].g, pca_rgb.rgb[0].b);
-} // uniform_Step
+  return true;
+} // buildPanelPlan
 #endif
 
-#if 1 // cloud colour cycle
+#if 1 // PCA low level routines
+/**********************************************************************
+  PCA9685
+  
+  Low Level Routines
+**********************************************************************/
 /*---------------------------------------------------------------------
-  Cloud colour cycle
-
-  Pick two random colours for first (s0) and last (sn) strip
-  Interpolate linearly each strip in between
-  Pick two more random colours for first and last strip
-  Fade to the new colours across all strips in random steps
+  pca_init
+  
+  Initialize a PCA9685 IC as required for operation
 ---------------------------------------------------------------------*/
-void cloud_Init(void)
+bool pca_init(uint8_t addr)
 {
-  // Initialize first and last strip
-  // Interpolate each strip in between
-  // Prepare for first ReInit
+  uint8_t buff[3];
+  uint8_t b = 0;
 
-  Serial.println(F("cloud_init..."));
+  if (stubPCA)
+  {
+    Serial << F("WARNING: pca_init: PCA is stubbed.") << endl;
+    return true;
+  }
 
-  double s0, sn;
+  Serial << F("pca_init[") << _HEX(addr) << F("]...");
+  //  return true;
 
-  // Get some random numbers [0..1)
-  s0 = random(100) / 100.0;
-  sn = random(100) / 100.0;
+  // PRE_SCALE only takes writes during SLEEP, which is set after a
+  // reset anyway. Cleared below, LEDn writes start the PWM.
+  const uint8_t sleep = 0x31; // AI, SLEEP, ALLCALL
+  if (!pca_write_regs(addr, 0x00, &sleep, 1) || !pca_write_regs(addr, 0xFE, &pcaPrescale, 1))
+    return false;
 
-  s0 = 0.0;
-  sn = 1.0 / 6.0;
+  //  ABORT_UNLESS(iic.start(addr | I2C_WRITE));
+  //  brzo_i2c_start_transaction(addr, iicFreq);
 
-  s0 = 0.0;
-  sn = 0.0;
+  // Select Mode 1 register
+  //  ABORT_UNLESS(iic.write(0));
+  buff[b++] = 0;
+  //  brzo_i2c_write(buff, 1, false);
 
-  // Calculate interval size between strips
-  double sd = (sn - s0) * (1.0 / (double)(MAX_STRIPS - 1));
+  /*
+    Mode 1 register
+    7 restart 0
+    6 extclk  0 // 0: Use internal clock
+    5 ai    1 // 1: Auto Increment on
+    4 sleep   0
+    3 sub1    0
+    2 sub2    0
+    1 sub3    0
+    0 allcall 1 // 1: Enable All_CALL address
+    
+    0 0 1 0 . 0 0 0 1
+  */
+  //  ABORT_UNLESS(iic.write(0x21));
+  buff[b++] = 0x21;
+  //  brzo_i2c_write(buff, 1, false);
 
-#if 1
-  DBG_INIT(40)
-  //  "Initial s0=%g sn=%g, sd=%g", s0, sn, sd
-  "Initial s0=%f sn=%f, sd=%f", s0, sn, sd DBG_DONE
-#endif
+  /*
+    Mode 2 register
+    7 reserved  0
+    6 reserved  0
+    5 reserved  0
+    4 invrt   0 // 0: not inverted (driver), 1: inverted (no driver)
+    3 och   0 // output change: 0: stop cmd, 1: ack
+              // Keep 0: synchronized output relies on all PCAs latching on one STOP
+    2 outdrv  1 // 0: open-drain, 1: totem pole
+    1 outne1  0 // /OE=1 & 00: LEDn=0   10: high impedance
+    0 outne0  0 //  01 & OUTDRV=1: LDEn=1, OUTDRV=0: high impedance
 
-      // Initialize strips
-      for (uint8_t i = 0; i < MAX_STRIPS; i++)
-  {
-    strip[i].h = s0 + sd * (double)i;
-    //    sx = s0 + sd * (double) i;
-    //    strip[i].h = sx;
-    strip[i].s = 1;
-    strip[i].v = 1;
+    0 0 0 0 . 0 1 0 0
+  */
+  //  ABORT_UNLESS(iic.write(0x04));
+  buff[b++] = 0x04;
 
-#if 1
-    DBG_INIT(24)
-    "strip[%d] = %g", i, strip[i].h DBG_DONE
-#endif
+  Serial << F("pca_init(): count buff elements: ") << b << "/" << sizeof(buff) << endl;
 
-                             hsv2pca(strip[i].h, strip[i].s, strip[i].v, &pca_rgb.rgb[i].r, &pca_rgb.rgb[i].g, &pca_rgb.rgb[i].b);
-  }
+  brzo_i2c_start_transaction(addr, iicFreq);
+  brzo_i2c_write(buff, b, false);
 
-  countSteps = 0; // Next step is to recalculate new delta and step values
-  Serial << F("cloud_init...done") << endl;
-} // cloud_init
+  //  iic.stop();
+  //  ABORT_UNLESS(res = brzo_i2c_end_transaction());
+  uint8_t res = brzo_i2c_end_transaction();
+  Serial << res << F("... done.") << endl;
+  return (res == 0);
+
+  // ABORT:
+  // Do some magic here
+  //  iic.stop();
+  //  Serial << F("pca_init: IIC ERROR on line: ") << _ABORT_LINE << endl;
+  //  Serial << F("pca_init: IIC ERROR on line: ") << _ABORT_LINE << endl;
+  //  return false;
+} // pca_init
 
-void cloud_Step(void)
+/*---------------------------------------------------------------------
+  pca_verify
+  
+  Write test patterns to the SUBADR1..3 registers of a PCA at the given
+  clock and read them back. SUBADR responses are disabled in MODE1, so
+  the patterns are harmless. Defaults are restored afterwards.
+  
+  Returns
+    number of failed transactions and mismatches
+---------------------------------------------------------------------*/
+uint8_t pca_verify(uint8_t addr, uint16_t freq)
 {
+  // Bit 0 of SUBADRx is read only 0
+  const uint8_t patterns[][3] = {
+      {0x54, 0xAA, 0x32},
+      {0xAA, 0x54, 0xCC},
+      {0xFE, 0x00, 0x0E},
+      {0x00, 0xFE, 0xF0},
+      {0xE2, 0xE4, 0xE8}}; // Power up defaults last
+  uint8_t errors = 0;
+
+  for (uint8_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++)
+  {
+    uint8_t buff[4];
+    uint8_t res;
 
-#if 0
-    DBG_INIT(24)
-    "cloud_step[%d|%d]...", countSteps, countMaxSteps
-    DBG_DONE
-#endif
+    buff[0] = 0x02; // select SUBADR1
+    memcpy(&buff[1], patterns[p], 3);
 
-  if (countSteps <= 0)
-  {
-    //    digitalWriteFast(13, HIGH);
-    digitalWrite(13, HIGH);
-    cloud_ReInit();
-    delay(1000);
-    //    digitalWriteFast(13, LOW);
-    digitalWrite(13, HIGH);
-    return;
+    brzo_i2c_start_transaction(addr, freq);
+    brzo_i2c_write(buff, 4, false);
+    res = brzo_i2c_end_transaction();
+    if (res)
+    {
+      errors++;
+      continue;
+    }
+
+    uint8_t reg = 0x02;
+    brzo_i2c_start_transaction(addr, freq);
+    brzo_i2c_write(&reg, 1, true);
+    brzo_i2c_read(buff, 3, false);
+    res = brzo_i2c_end_transaction();
+    if (res || memcmp(buff, patterns[p], 3))
+      errors++;
   }
 
-  // Update HSV & RGB values for current step
-  for (uint8_t i = 0; i < MAX_STRIPS; i++)
-  {
-    strip[i].h += hsvDelta[i].h;
+  return errors;
+} // pca_verify
 
-    // Handle over- and underrun of hue
-    if (strip[i].h > 1)
-      strip[i].h -= 1;
-    if (strip[i].h < 0)
-      strip[i].h += 1;
+/*---------------------------------------------------------------------
+  pca_write_leds
+  
+  Write count LEDn registers starting at channel first in one
+  auto increment transaction
+---------------------------------------------------------------------*/
+bool pca_write_leds(uint8_t chip, uint8_t first, uint8_t count, uint16_t *on, uint16_t *off)
+{
+  uint8_t buff[1 + PCA_CHANNELS * 4];
+  uint8_t b = 0;
 
-    //    Serial.print(strip[i].h, 6); Serial.print(F(" "));
+  buff[b++] = 0x06 + first * 4; // select 1st PWM register
 
-    // Calculate RGB
-    hsv2pca(strip[i].h, strip[i].s, strip[i].v,
-            &pca_rgb.rgb[i].r, &pca_rgb.rgb[i].g, &pca_rgb.rgb[i].b);
+  for (uint8_t i = first; i < first + count; i++)
+  {
+    buff[b++] = on[i] & 0xFF;         // LED on LOW
+    buff[b++] = (on[i] >> 8) & 0x0F;  // LED on HIGH (4 bits)
+    buff[b++] = off[i] & 0xFF;        // LED off LOW
+    buff[b++] = (off[i] >> 8) & 0x1F; // LED off HIGH (4 bits and full OFF)
   }
 
-  //  Serial.println();
+  iicTransactions++;
+  iicBytes += b;
 
-  countSteps--;
-  return;
-} // cloud_step
+  if (syncOutput || timedOutput)
+    return pca_queue(chip, buff, b);
 
-void cloud_ReInit(void)
-{
-  Serial << F("cloud_ReInit...") << millis() << endl;
+  if (stubPCA)
+  {
+    return true;
+  }
 
-  double s0, sn;
+  brzo_i2c_start_transaction(chip, iicFreq);
+  brzo_i2c_write(buff, b, false);
 
-  // Calculate new targets
-  // ### need to take care that targets do not differ too much?
-  //  s0 = random(100) / 100.0;
-  //  sn = random(100) / 100.0;
+  uint8_t res = brzo_i2c_end_transaction();
+  if (res)
+  {
+    Serial << F("pca_write_leds(): IIC error code: ") << res << endl;
+    rgbTelemetry.iicErrors++;
+  }
+  return (res == 0);
+} // pca_write_leds
 
-  // Make distance large enough. One color has ~ 100/6 = 16.6
-  // Make distance not too large so it spreads nice across MAX_STRIPS
-  s0 = random(100) / 100.0;
-  sn = s0 + (random(25, 75) / 100.0) * ((random(0, 2) == 0) ? 1.0 : -1.0);
+/*---------------------------------------------------------------------
+  pca_queue
+  
+  Append a write of len bytes to addr to the queue of the frame.
+  Never sends: a frame goes out with one STOP, in timed output from
+  the Ticker only. If out of space the write fails and iicQueueFull
+  has updatePanel drop the frame.
+---------------------------------------------------------------------*/
+bool pca_queue(uint8_t addr, const uint8_t *buff, uint8_t len)
+{
+  if (iicSegmentCount == IIC_MAX_SEGMENTS || iicQueueLen + len > sizeof(iicQueue))
+  {
+    iicQueueFull = true;
+    return false;
+  }
+  memcpy(&iicQueue[iicQueueLen], buff, len);
+  iicSegments[iicSegmentCount].addr = addr;
+  iicSegments[iicSegmentCount].pos = iicQueueLen;
+  iicSegments[iicSegmentCount].len = len;
+  iicSegmentCount++;
+  iicQueueLen += len;
+  return true;
+} // pca_queue
 
-  //  s0 = strip[MAX_STRIPS - 1].h; // Start where we left off
-  //  sn = s0 + 1.0 / 6.0;      // Advance one color
+/*---------------------------------------------------------------------
+  pca_flush_queue
+  
+  Send all queued writes now
+---------------------------------------------------------------------*/
+bool pca_flush_queue(void)
+{
+  uint8_t res = pca_send_segments(iicQueue, iicSegments, iicSegmentCount);
+  if (res)
+  {
+    Serial << F("pca_flush_queue(): IIC error code: ") << res << endl;
+    rgbTelemetry.iicErrors++;
+  }
 
-  //  s0 = strip[MAX_STRIPS - 1].h; // Start where we left off
-  //  s0 += 1.0 / 6.0;
-  //  sn = s0 + 1.0 / 6.0;      // Advance one color
+  iicQueueLen = 0;
+  iicSegmentCount = 0;
+  return (res == 0);
+} // pca_flush_queue
 
-  // Rebound sx to [0, 1)
-  if (s0 >= 1.0)
-    s0 -= 1.0;
-  if (s0 < 0.0)
-    s0 += 1.0;
+/*---------------------------------------------------------------------
+  pca_send_segments
+  
+  Send count queued writes in one bus transaction. Every segment but
+  the last ends in a repeated start instead of a STOP. brzo only latches
+  address and clock in brzo_i2c_start_transaction, START and address
+  byte are sent by the write, so the address can change per segment.
+  brzo_i2c_start_transaction clears the error code, so every segment
+  is closed with brzo_i2c_end_transaction. That only hands back the
+  code, the STOP is up to the write.
+  No Serial output, also called by the output Ticker.
+  
+  Returns
+    brzo status code of the first failed segment, 0 on success
+---------------------------------------------------------------------*/
+uint8_t pca_send_segments(const uint8_t *queue, const iic_segment_st *segments, uint16_t count)
+{
+  uint8_t res = 0;
 
-  if (sn >= 1.0)
-    sn -= 1.0;
-  if (sn < 0.0)
-    sn += 1.0;
+  if (stubPCA || !count)
+    return 0;
 
-  // Calculate interval between first and last strip
-  double sd = (sn - s0);
-  // Take the shorter way in color circle
-  if (sd > 0.5)
-    sd = -(1.0 - sd);
-  if (sd < -0.5)
-    sd = 1.0 + sd;
-  // Delta from one strip to the next
-  sd *= (1.0 / (double)(MAX_STRIPS - 1));
+  for (uint16_t i = 0; i < count; i++)
+  {
+    brzo_i2c_start_transaction(segments[i].addr, iicFreq);
+    brzo_i2c_write((uint8_t *)&queue[segments[i].pos], segments[i].len, i < count - 1);
 
-#if 1
-  //  DBG_INIT(45)
-  //  "New s0=%f sn=%f, sd=%f", s0, sn, sd
-  //  DBG_DONE
-
-  Serial << F("New s0=");
-  Serial.print(s0, 8);
-  Serial << F(" sn=");
-  Serial.print(sn, 8);
-  Serial << F(" sd=");
-  Serial.print(sd, 8);
-  Serial << '\n';
-#endif
+    uint8_t r = brzo_i2c_end_transaction();
+    if (!res)
+      res = r;
+  }
+  return res;
+} // pca_send_segments
 
-  // Calculate steps to reach till new target
-  // ### need to take care that enough steps for large target diffs?
-  countSteps = countMaxSteps = 100; // random(256);
+/*---------------------------------------------------------------------
+  pca_send_frame
+  
+  Send the prepared frame in one bus transaction, like
+  pca_send_segments.
+  
+  Returns
+    brzo status code of the first failed segment, 0 on success
+---------------------------------------------------------------------*/
+uint8_t pca_send_frame(const uint8_t *frame, uint16_t len)
+{
+  uint16_t pos = 0;
+  uint8_t res = 0;
 
-#if 1
-  DBG_INIT(20)
-  "countMaxSteps=%d", countMaxSteps
-                          DBG_DONE
-#endif
+  if (stubPCA || !len)
+    return 0;
 
-      // Next cycle goes from strip[i].h to s0 + sd * i in countMaxSteps steps
-      for (uint8_t i = 0; i < MAX_STRIPS; i++)
+  while (pos < len)
   {
-    double from = strip[i].h;
-    double to = s0 + sd * (double)i;
-    double diff = (to - from) / (double)(countMaxSteps);
+    uint8_t addr = frame[pos++];
+    uint8_t b = frame[pos++];
 
-    hsvDelta[i].h = diff;
-    hsvDelta[i].s = 0;
-    hsvDelta[i].v = 0;
+    brzo_i2c_start_transaction(addr, iicFreq);
+    brzo_i2c_write((uint8_t *)&frame[pos], b, pos + b < len);
+    pos += b;
 
-#if 1
-    //    DBG_INIT(55)
-    //    "strip[%d]=%f to=%f diff=%f", i, strip[i].h, to, diff
-    //    DBG_DONE
-
-    Serial << F("strip[") << i << F("]=");
-    Serial.print(strip[i].h, 8);
-    Serial << F(" to=");
-    Serial.print(to, 8);
-    Serial << F(" diff=");
-    Serial.print(diff, 8);
-    Serial << '\n';
-#endif
+    uint8_t r = brzo_i2c_end_transaction();
+    if (!res)
+      res = r;
   }
-  Serial.println(F("cloud_ReInit...done"));
-} // cloud_ReInit
-#endif
-
-#if 1 // Panel related routines
-/**********************************************************************
-  Panel related functions
-**********************************************************************/
+  return res;
+} // pca_send_frame
 
 /*---------------------------------------------------------------------
-  updatePanel
+  pca_write_regs
   
-  Write colour arrays to the panel for display
+  Write len bytes to the registers of a PCA from reg on, right away in
+  a transaction of its own. For mode and sleep changes, never queued.
 ---------------------------------------------------------------------*/
-void updatePanel(void)
+bool pca_write_regs(uint8_t addr, uint8_t reg, const uint8_t *data, uint8_t len)
 {
+  uint8_t buff[1 + 4];
 
-  //  dump_structures();
-  //  return;
+  if (stubPCA)
+    return true;
 
-  uint8_t channels = MAX_STRIPS * 3;
-  uint8_t chip = PCA_BASE_ADDRESS;
+  buff[0] = reg;
+  memcpy(&buff[1], data, min(len, (uint8_t)4));
 
-  // Each PCA has 16 channels. We only use 15 at most (R, G, B)
-  // Every Strip requires 3 channels (RGB), so we have at most 5 strips per PCA
+  brzo_i2c_start_transaction(addr, iicFreq);
+  brzo_i2c_write(buff, 1 + min(len, (uint8_t)4), false);
 
-  for (uint8_t i = 0; i < MAX_STRIPS * 3; i += 15, chip += 2)
+  uint8_t res = brzo_i2c_end_transaction();
+  if (res)
   {
-    pca_rgb_update(&pca_rgb.a[i], chip, min(channels, (uint8_t)15));
-
-    if (channels > 15)
-      channels -= 15;
+    Serial << F("pca_write_regs(): IIC error code: ") << res << endl;
+    rgbTelemetry.iicErrors++;
   }
+  return (res == 0);
+} // pca_write_regs
 
-  // IIC Stop here to update all PCAs on STOP?
-  // Might require restart in update function!
-}
+/*---------------------------------------------------------------------
+  pca_probe
+  
+  Look for a device at addr. Only sets the register pointer.
+  
+  Returns
+    true if the address is acknowledged
+---------------------------------------------------------------------*/
+bool pca_probe(uint8_t addr)
+{
+  uint8_t reg = 0x00;
+
+  brzo_i2c_start_transaction(addr, iicFreq);
+  brzo_i2c_write(&reg, 1, false);
+  return (brzo_i2c_end_transaction() == 0);
+} // pca_probe
 
 /*---------------------------------------------------------------------
-  initPanel
+  pca_set_prescale
   
-  Initialize all PCA9685 ICs as required for operation
+  Program pcaPrescale into all PCAs while running. PRE_SCALE needs
+  SLEEP, so each awake PCA gets SLEEP, PRE_SCALE and wake in a row,
+  then after one oscillator start up for all of them RESTART. The PWM
+  resumes with its LEDn registers unchanged, the PCAs are dark for
+  well below a millisecond. Sleeping PCAs only get PRE_SCALE.
 ---------------------------------------------------------------------*/
-void initPanel(void)
+void pca_set_prescale(void)
 {
-  uint8_t buff[1];
-  uint8_t b = 0;
+  const uint8_t sleep = 0x31;   // AI, SLEEP, ALLCALL
+  const uint8_t wake = 0x21;    // AI, ALLCALL
+  const uint8_t restart = 0xA1; // RESTART, AI, ALLCALL
+  bool ok = true;
 
-  if (stubPCA)
+  for (uint8_t c = 0; c < pcaChips; c++)
   {
-    Serial << F("WARNING: initPanel: PCA is stubbed.") << endl;
-    return;
-  }
+    uint8_t addr = pcaPlan[c].addr;
 
-  // Reset IIC bus
-  Serial << F("initPanel: Reset IIC.") << endl;
-  //  iic.start(0x00 | I2C_WRITE);
-  //  iic.write(0x06);
-  //  iic.stop();
+    if (pcaPower[c].state == pcaAsleep)
+      ok = pca_write_regs(addr, 0xFE, &pcaPrescale, 1) && ok;
+    else
+      ok = pca_write_regs(addr, 0x00, &sleep, 1) && pca_write_regs(addr, 0xFE, &pcaPrescale, 1) &&
+           pca_write_regs(addr, 0x00, &wake, 1) && ok;
+  }
 
-  buff[b++] = 0x06;
+  delayMicroseconds(PCA_WAKE_US);
 
-  brzo_i2c_start_transaction(0x00, IIC_FREQ);
-  brzo_i2c_write(buff, b, false);
-  uint8_t res = brzo_i2c_end_transaction();
-  Serial << F("initPanel: IIC Status: ") << res << endl;
+  for (uint8_t c = 0; c < pcaChips; c++)
+  {
+    if (pcaPower[c].state != pcaAsleep)
+      ok = pca_write_regs(pcaPlan[c].addr, 0x00, &restart, 1) && ok;
+  }
 
-  for (uint8_t addr = PCA_BASE_ADDRESS; addr <= PCA_LAST_ADDRESS; addr += 2)
+  // A PCA may be stuck in SLEEP or at the old frequency, start over
+  if (!ok)
   {
-    // Init PCAs to default values
-    //    Serial << F("initPanel: init PCA9685 at ") << _HEX(addr) << ':' << addr << '\n';
-    pca_init(addr);
+    Serial << F("pca_set_prescale: IIC error, init panel") << endl;
+    initPanel();
   }
-} // initPanel
-#endif
+} // pca_set_prescale
 
-#if 1 // PCA low level routines
-/**********************************************************************
-  PCA9685
-  
-  Low Level Routines
-**********************************************************************/
 /*---------------------------------------------------------------------
-  pca_init
+  pca_write_all_led
   
-  Initialize a PCA9685 IC as required for operation
+  Write ALL_LED_ON/OFF (0xFA..0xFD) via the ALL_CALL address.
+  Sets every channel of every PCA in one 5 byte transaction.
 ---------------------------------------------------------------------*/
-bool pca_init(uint8_t addr)
+bool pca_write_all_led(uint16_t on, uint16_t off)
 {
-  uint8_t buff[3];
+  uint8_t buff[5];
   uint8_t b = 0;
 
+  buff[b++] = 0xFA;                 // select ALL_LED_ON_L
+  buff[b++] = on & 0xFF;            // ALL_LED on LOW
+  buff[b++] = (on >> 8) & 0x0F;     // ALL_LED on HIGH (4 bits)
+  buff[b++] = off & 0xFF;           // ALL_LED off LOW
+  buff[b++] = (off >> 8) & 0x1F;    // ALL_LED off HIGH (4 bits and full OFF)
+
+  iicTransactions++;
+  iicBytes += b;
+
+  // Goes out with the frame like pca_write_leds
+  if (syncOutput || timedOutput)
+    return pca_queue(PCA_ALLCALL_ADDRESS, buff, b);
+
   if (stubPCA)
   {
-    Serial << F("WARNING: pca_init: PCA is stubbed.") << endl;
     return true;
   }
 
-  Serial << F("pca_init[") << _HEX(addr) << F("]...");
-  //  return true;
-
-  //  ABORT_UNLESS(iic.start(addr | I2C_WRITE));
-  //  brzo_i2c_start_transaction(addr, IIC_FREQ);
-
-  // Select Mode 1 register
-  //  ABORT_UNLESS(iic.write(0));
-  buff[b++] = 0;
-  //  brzo_i2c_write(buff, 1, false);
-
-  /*
-    Mode 1 register
-    7 restart 0
-    6 extclk  0 // 0: Use internal clock
-    5 ai    1 // 1: Auto Increment on
-    4 sleep   0
-    3 sub1    0
-    2 sub2    0
-    1 sub3    0
-    0 allcall 1 // 1: Enable All_CALL address
-    
-    0 0 1 0 . 0 0 0 1
-  */
-  //  ABORT_UNLESS(iic.write(0x21));
-  buff[b++] = 0x21;
-  //  brzo_i2c_write(buff, 1, false);
-
-  /*
-    Mode 2 register
-    7 reserved  0
-    6 reserved  0
-    5 reserved  0
-    4 invrt   0 // 0: not inverted (driver), 1: inverted (no driver)
-    3 och   0 // output change: 0: stop cmd, 1: ack
-    2 outdrv  1 // 0: open-drain, 1: totem pole
-    1 outne1  0 // /OE=1 & 00: LEDn=0   10: high impedance
-    0 outne0  0 //  01 & OUTDRV=1: LDEn=1, OUTDRV=0: high impedance
-
-    0 0 0 0 . 0 1 0 0
-  */
-  //  ABORT_UNLESS(iic.write(0x04));
-  buff[b++] = 0x04;
-
-  Serial << F("pca_init(): count buff elements: ") << b << "/" << sizeof(buff) << endl;
-
-  brzo_i2c_start_transaction(addr, IIC_FREQ);
+  brzo_i2c_start_transaction(PCA_ALLCALL_ADDRESS, iicFreq);
   brzo_i2c_write(buff, b, false);
 
-  //  iic.stop();
-  //  ABORT_UNLESS(res = brzo_i2c_end_transaction());
   uint8_t res = brzo_i2c_end_transaction();
-  Serial << res << F("... done.") << endl;
+  if (res)
+  {
+    Serial << F("pca_write_all_led(): IIC error code: ") << res << endl;
+    rgbTelemetry.iicErrors++;
+  }
   return (res == 0);
+} // pca_write_all_led
 
-  // ABORT:
-  // Do some magic here
-  //  iic.stop();
-  //  Serial << F("pca_init: IIC ERROR on line: ") << _ABORT_LINE << endl;
-  //  Serial << F("pca_init: IIC ERROR on line: ") << _ABORT_LINE << endl;
-  //  return false;
-} // pca_init
+/*---------------------------------------------------------------------
+  pcaOffTime
+  
+  OFF time of a channel with a 12 bit duty switching on at on, as
+  written to LEDn_OFF and kept in the shadows. PCA_FULL_OFF if dark.
+---------------------------------------------------------------------*/
+uint16_t pcaOffTime(uint16_t duty, uint16_t on)
+{
+  return duty ? (duty + on) & 0x0FFF : PCA_FULL_OFF;
+} // pcaOffTime
 
 /*---------------------------------------------------------------------
   pca_rgb_update
   
   Write RGB values to count PWM registers of the PCA
   Starting with first
+  Channel i switches on at phase[i], or at 0 without phases. The OFF
+  time wraps around the 4096 tick period, the duty stays the same.
+  A duty of 0 is sent as full OFF, see pcaOffTime.
+
+  Only channels that differ from the shadow copy are sent. Changed
+  channels are grouped into runs. A gap of unchanged channels between
+  two runs is bridged if rewriting it is cheaper than another
+  transaction. With a linear cost model this gives the cheapest mix of
+  one block write and several short auto increment writes.
 ---------------------------------------------------------------------*/
-void pca_rgb_update(uint16_t *arr, uint8_t chip, uint8_t count)
+void pca_rgb_update(uint16_t *arr, const uint16_t *phase, uint8_t chip, uint8_t count, pca_shadow_st *shadow)
 {
 #if 0
   DBG_INIT(32)
@@ -1519,96 +4441,265 @@ void pca_rgb_update(uint16_t *arr, uint8_t chip, uint8_t count)
   DBG_DONE
 #endif
 
-  uint8_t buff[62]; // why 62?
-  uint8_t b = 0;
-
-  //  ABORT_UNLESS(iic.start(chip | I2C_WRITE));  // Start communication, select chip
-  //  brzo_i2c_start_transaction(chip, IIC_FREQ);
-
-  //  ABORT_UNLESS(iic.write(0x06));        // select 1st PWM register
-  /*  { 
-    uint8_t reg = 0x06;
-    brzo_i2c_write(&reg, 1, false);
-  }
-*/
-  buff[b++] = 0x06; // select 1st PWM register
+  uint16_t on[PCA_CHANNELS];
+  uint16_t off[PCA_CHANNELS];
+  uint16_t changed = 0; // bit n set: channel n differs from shadow
 
-  // Update all PWM registers
   for (uint8_t i = 0; i < count; i++)
   {
-    //    uint16_t on = i * 1;
-    uint16_t on = 0;
-    uint16_t off = arr[i] + on;
+    on[i] = phase ? phase[i] : 0;
+    off[i] = pcaOffTime(arr[i], on[i]);
 
-    uint8_t on_l = on & 0xFF;
-    uint8_t on_h = (on >> 8) & 0x0F;
+    if (!shadow->valid || on[i] != shadow->on[i] || off[i] != shadow->off[i])
+      changed |= (1 << i);
+  }
 
-    uint8_t off_l = off & 0xFF;
-    uint8_t off_h = (off >> 8) & 0x0F;
+  // Nothing changed, nothing to send
+  if (!changed)
+    return;
 
-#if 0
-    DBG_INIT(64)
-    "arr[%d]: %d(%d:%d) %d(%d:%d)", 
-        arr[i], 
-        on, on_h, on_l, 
-        off, off_h, off_l
-    DBG_DONE
-#endif
-    // LED on LOW
-    //    ABORT_UNLESS(iic.write(on_l));
-    //    brzo_i2c_write(&on_l, 1, false);
-    // LED on HIGH
-    //    ABORT_UNLESS(iic.write(on_h));
-    //    brzo_i2c_write(&on_h, 1, false);
-    // LED off LOW
-    //    ABORT_UNLESS(iic.write(off_l));
-    //    brzo_i2c_write(&off_l, 1, false);
-    // LED off HIGH (4 bits)
-    //    ABORT_UNLESS(iic.write(off_h));
-    //    brzo_i2c_write(&off_h, 1, false);
-    buff[b++] = on_l;
-    buff[b++] = on_h;
-    buff[b++] = off_l;
-    buff[b++] = off_h;
-  }
-
-  //  Serial << F("pca_rgb_update(): count buff elements: ") << b << "/" << sizeof(buff) << endl;
+  // Largest gap of unchanged channels that is cheaper to rewrite than
+  // to start another transaction for
+  const uint8_t maxGap = PCA_TRANSACTION_COST / PCA_CHANNEL_COST;
 
-  if (stubPCA)
-  {
-//    Serial << F("WARNING: pca_rgb_update: PCA is stubbed.") << endl;
-    return;
-  }
-  else
+  uint8_t i = 0;
+  while (i < count)
   {
-    brzo_i2c_start_transaction(chip, IIC_FREQ);
-    brzo_i2c_write(buff, b, false);
+    if (!(changed & (1 << i)))
+    {
+      i++;
+      continue;
+    }
 
-    uint8_t res = brzo_i2c_end_transaction();
-    if (res)
+    // Start of a run. Extend it across changed channels and cheap gaps
+    uint8_t first = i;
+    uint8_t last = i;
+    for (uint8_t j = i + 1; j < count && j <= last + maxGap + 1; j++)
     {
-      Serial << F("pca_rgb_update(): IIC error code: ") << res << endl;
+      if (changed & (1 << j))
+        last = j;
     }
-    return;
+
+    bool ok = pca_write_leds(chip, first, last - first + 1, on, off);
+
+    for (uint8_t j = first; j <= last; j++)
+    {
+      shadow->on[j] = on[j];
+      shadow->off[j] = off[j];
+    }
+    if (!ok)
+    {
+      // Chip state unknown, resend everything next time
+      shadow->valid = false;
+      return;
+    }
+    i = last + 1;
   }
 
-  //ABORT:
-  //  Serial << F("pca_rgb_update: IIC ERROR on line: "); Serial.println(_ABORT_LINE);
-  //  iic.stop();
+  // Channels beyond count are never written and do not matter
+  shadow->valid = true;
 } // pca_rgb_update
 #endif
 
 #if 1 // HSV, RGB, PCA colour conversion
 /**********************************************************************
-  hsv2pca
+  scale16
+  
+  Multiply a by the fraction b/65536 with b=65535 treated as 1.0
+  (a * (b + 1)) >> 16 keeps full scale values at full scale
+**********************************************************************/
+static inline uint16_t scale16(uint16_t a, uint16_t b)
+{
+  return ((uint32_t)a * ((uint32_t)b + 1)) >> 16;
+} // scale16
+
+/**********************************************************************
+  hsv2rgbFixed
+  
+  Integer only HSV to RGB conversion
+  
+  h wrapping 16bit angle: 0..65535 is one full turn of the colour wheel
+  s, v Q16 fractions: 0..65535 is 0..1
+  r, g, b Q16 fractions
+**********************************************************************/
+void hsv2rgbFixed(uint16_t h, uint16_t s, uint16_t v, uint16_t *_r, uint16_t *_g, uint16_t *_b)
+{
+  // Split h * 6 into sector (integer part) and position in sector (Q16)
+  uint32_t h6 = (uint32_t)h * 6;
+  uint8_t i = h6 >> 16;
+  uint16_t f = h6 & 0xFFFF;
+
+  uint16_t p = scale16(v, 65535 - s);
+  uint16_t q = scale16(v, 65535 - scale16(f, s));
+  uint16_t t = scale16(v, 65535 - scale16(65535 - f, s));
+
+  switch (i)
+  {
+  case 0:
+    *_r = v, *_g = t, *_b = p;
+    break;
+  case 1:
+    *_r = q, *_g = v, *_b = p;
+    break;
+  case 2:
+    *_r = p, *_g = v, *_b = t;
+    break;
+  case 3:
+    *_r = p, *_g = q, *_b = v;
+    break;
+  case 4:
+    *_r = t, *_g = p, *_b = v;
+    break;
+  default:
+    *_r = v, *_g = p, *_b = q;
+    break;
+  }
+} // hsv2rgbFixed
+
+/**********************************************************************
+  hsv2pcaFixed
+  
+  Integer only HSV to PCA conversion. The ESP8266 has no FPU, so this
+  is the path used by all colour cycles.
+  
+  h, s, v as for hsv2rgbFixed
+  
+  Output is the 16 bit frame range (Q16 RGB), shifted down by 4 it is
+  within 1 LSB of hsv2pcaDouble (12bit, 0..4095). White balance is left
+  to the calibration of the output path.
+**********************************************************************/
+void hsv2pcaFixed(uint16_t h, uint16_t s, uint16_t v, uint16_t *_r, uint16_t *_g, uint16_t *_b)
+{
+  hsv2rgbFixed(h, s, v, _r, _g, _b);
+} // hsv2pcaFixed
+
+/**********************************************************************
+  OKLab
+  
+  Perceptual colour space by Bjoern Ottosson. Straight lines in OKLab
+  keep lightness and perceived speed even, where hue fades go muddy
+  half way between distant colours.
+  
+  Integer only. L, a and b are Q15 (L 0..32767, a and b within about
+  +-10000), RGB is Q16 and linear in light like the PCA duty cycle, so
+  there is no transfer curve. Coefficients are Q12 or Q14 and chosen so
+  that white maps to L = 1, a = b = 0 exactly.
+  The cube root of RGB to OKLab comes from a LUT, the way back, which
+  runs per strip and frame, only needs cubes. The LUT is computed by
+  the compiler and lives in flash, like the output curves.
+**********************************************************************/
+const uint16_t CBRT_LUT_SIZE = 256;
+
+// x^(1/3) for x in 0..1, Newton's method from above
+constexpr double cbrtRoot3(double x)
+{
+  double r = 1;
+
+  if (x <= 0)
+    return 0;
+  for (uint8_t i = 0; i < 40; i++)
+    r = (2 * r + x / (r * r)) / 3;
+  return r;
+}
+
+struct cbrt_lut_st
+{
+  uint16_t v[CBRT_LUT_SIZE + 1]; // cbrt(i / 256), Q15
+
+  constexpr cbrt_lut_st() : v()
+  {
+    for (uint16_t i = 0; i <= CBRT_LUT_SIZE; i++)
+      v[i] = cbrtRoot3((double)i / CBRT_LUT_SIZE) * 32768 + 0.5;
+  }
+};
+
+constexpr cbrt_lut_st cbrtLut PROGMEM = cbrt_lut_st();
+
+// Cube root of a Q16 fraction (0..65536) as Q15. Linear between LUT
+// entries. Below the first entry, where cbrt is steepest, x is scaled
+// up by 2^6 (cbrt by 2^2) until it is past it.
+static uint16_t cbrtQ16(uint32_t x)
+{
+  uint8_t shift = 0;
+
+  if (!x)
+    return 0;
+
+  while (x < 65536 / CBRT_LUT_SIZE)
+  {
+    x <<= 6;
+    shift += 2;
+  }
+
+  uint16_t i = x >> 8;
+  uint16_t f = x & 0xFF;
+  uint16_t c = pgm_read_word(&cbrtLut.v[i]);
+  if (f)
+    c += ((int32_t)(pgm_read_word(&cbrtLut.v[i + 1]) - c) * f) >> 8;
+  return c >> shift;
+} // cbrtQ16
+
+/*
+  rgb2oklab
+  
+  Q16 linear RGB to Q15 OKLab, used when a fade starts
+*/
+void rgb2oklab(uint16_t r, uint16_t g, uint16_t b, int16_t *_L, int16_t *_a, int16_t *_b)
+{
+  // Cone responses, Q16, rows sum to 4096
+  int32_t l = cbrtQ16((1688UL * r + 2197UL * g + 211UL * b) >> 12);
+  int32_t m = cbrtQ16((868UL * r + 2788UL * g + 440UL * b) >> 12);
+  int32_t s = cbrtQ16((362UL * r + 1154UL * g + 2580UL * b) >> 12);
+
+  // L row sums to 16384, a and b rows to 0
+  *_L = min((3448 * l + 13003 * m - 67 * s) >> 14, (int32_t)32767);
+  *_a = (32408 * l - 39790 * m + 7382 * s) >> 14;
+  *_b = (424 * l + 12825 * m - 13249 * s) >> 14;
+} // rgb2oklab
+
+/*
+  oklab2pca
+  
+  Q15 OKLab to the 16 bit frame range, clipped to the RGB gamut.
+  Runs per strip and frame of an OKLab fade.
+*/
+void oklab2pca(int16_t L, int16_t a, int16_t b, uint16_t *_r, uint16_t *_g, uint16_t *_b)
+{
+  int32_t l = L + ((12987 * a + 7072 * b) >> 15);
+  int32_t m = L - ((3459 * a + 2092 * b) >> 15);
+  int32_t s = L - ((2932 * a + 42320 * b) >> 15);
+
+  l = constrain(l, 0, 32768);
+  m = constrain(m, 0, 32768);
+  s = constrain(s, 0, 32768);
+
+  // Cubes, Q15
+  l = (((l * l) >> 15) * l) >> 15;
+  m = (((m * m) >> 15) * m) >> 15;
+  s = (((s * s) >> 15) * s) >> 15;
+
+  // Q15 x Q12 >> 11 is Q16, rows sum to 4096
+  int32_t R = (16698 * l - 13548 * m + 946 * s) >> 11;
+  int32_t G = (-5196 * l + 10690 * m - 1398 * s) >> 11;
+  int32_t B = (-17 * l - 2881 * m + 6994 * s) >> 11;
+
+  *_r = constrain(R, 0, 65535);
+  *_g = constrain(G, 0, 65535);
+  *_b = constrain(B, 0, 65535);
+} // oklab2pca
+
+/**********************************************************************
+  hsv2pcaDouble
   
   Taken from RGBConverter class
   Robert Atkins, December 2010 (ratkins_at_fastmail_dot_fm).
   https://github.com/ratkins/RGBConverter
   
   Adapted to convert RGB values to PCA value range of 12bit (0..4095)
+
+  Reference implementation. Only used by hsvPerfTest.
 **********************************************************************/
-void hsv2pca(double h, double s, double v, uint16_t *_r, uint16_t *_g, uint16_t *_b)
+void hsv2pcaDouble(double h, double s, double v, uint16_t *_r, uint16_t *_g, uint16_t *_b)
 {
   double r = 0, g = 0, b = 0;
 
@@ -1646,11 +4737,9 @@ void hsv2pca(double h, double s, double v, uint16_t *_r, uint16_t *_g, uint16_t
   // ranges from 0..4095
   // typecast works as truncate?
   *_r = ((uint16_t)(r * 4095.0)) & 0x0FFF;
-  //    *_g = ((uint16_t)(g * 4095.0)) & 0x0FFF;
-  *_g = ((uint16_t)(g * 1023.0)) & 0x0FFF;
-  //    *_b = ((uint16_t)(b * 4095.0)) & 0x0FFF;
-  *_b = ((uint16_t)(b * 1023.0)) & 0x0FFF;
-} // hsv2pca
+  *_g = ((uint16_t)(g * 4095.0)) & 0x0FFF;
+  *_b = ((uint16_t)(b * 4095.0)) & 0x0FFF;
+} // hsv2pcaDouble
 
 #endif
 
@@ -1794,6 +4883,168 @@ int freeRam(void)
   return (int)&v - (__brkval == 0 ? (int)&__heap_start : (int)__brkval);
 } // freeRam
 
+/**********************************************************************
+  hsvPerfTest
+  
+  Measure CPU cycles per strip of the double and the fixed point HSV
+  to PCA conversion and of an OKLab fade step. Runs a number of frames
+  for the test (5) and the prod (15) panel size. Also reports the max
+  deviation of the fixed point result from the double reference and
+  of the OKLab round trip across the colour wheel.
+**********************************************************************/
+void hsvPerfTest(void)
+{
+  const uint8_t stripCounts[] = {5, 15};
+  const uint16_t frames = 100;
+
+  volatile uint16_t sink = 0; // keep the compiler from dropping the calls
+  uint16_t r, g, b;
+
+  Serial << F("hsvPerfTest: ") << frames << F(" frames") << endl;
+
+  for (uint8_t c = 0; c < sizeof(stripCounts); c++)
+  {
+    uint8_t n = stripCounts[c];
+    uint32_t conversions = (uint32_t)frames * n;
+
+    double hd = 0;
+    double hdStep = 1.0 / conversions;
+    uint32_t start = ESP.getCycleCount();
+    for (uint16_t f = 0; f < frames; f++)
+      for (uint8_t i = 0; i < n; i++)
+      {
+        hsv2pcaDouble(hd, 1, 1, &r, &g, &b);
+        sink += r + g + b;
+        hd += hdStep;
+      }
+    uint32_t cyclesDouble = ESP.getCycleCount() - start;
+
+    uint16_t hf = 0;
+    uint16_t hfStep = 65536 / conversions;
+    start = ESP.getCycleCount();
+    for (uint16_t f = 0; f < frames; f++)
+      for (uint8_t i = 0; i < n; i++)
+      {
+        hsv2pcaFixed(hf, 65535, 65535, &r, &g, &b);
+        sink += r + g + b;
+        hf += hfStep;
+      }
+    uint32_t cyclesFixed = ESP.getCycleCount() - start;
+
+    // OKLab fade from red to cyan as in cloud_Step
+    int16_t L0, a0, b0, L1, a1, b1;
+    rgb2oklab(65535, 0, 0, &L0, &a0, &b0);
+    rgb2oklab(0, 65535, 65535, &L1, &a1, &b1);
+    start = ESP.getCycleCount();
+    for (uint16_t f = 0; f < frames; f++)
+    {
+      int32_t q = ((uint32_t)f << 15) / frames;
+      for (uint8_t i = 0; i < n; i++)
+      {
+        oklab2pca(L0 + (((L1 - L0) * q) >> 15), a0 + (((a1 - a0) * q) >> 15), b0 + (((b1 - b0) * q) >> 15), &r, &g, &b);
+        sink += r + g + b;
+      }
+    }
+    uint32_t cyclesOklab = ESP.getCycleCount() - start;
+
+    Serial << n << F(" strips: double ") << cyclesDouble / conversions
+           << F(" fixed ") << cyclesFixed / conversions
+           << F(" oklab ") << cyclesOklab / conversions
+           << F(" cycles/strip, saved ") << (cyclesDouble - cyclesFixed) / frames
+           << F(" cycles/frame, oklab fade ") << cyclesOklab / frames
+           << F(" vs hsv ") << cyclesFixed / frames << F(" cycles/frame") << endl;
+  }
+
+  // Compare results for every 12bit hue step and a few s/v pairs
+  uint16_t maxDev = 0;
+  for (uint16_t h = 0; h < 4096; h++)
+    for (uint8_t sv = 1; sv <= 4; sv++)
+    {
+      uint16_t rd, gd, bd;
+      uint16_t x = min((uint32_t)sv * 16384, (uint32_t)65535);
+      hsv2pcaDouble(h / 4096.0, sv / 4.0, sv / 4.0, &rd, &gd, &bd);
+      hsv2pcaFixed(h << 4, x, x, &r, &g, &b);
+      r >>= 4, g >>= 4, b >>= 4;
+      maxDev = max(maxDev, (uint16_t)abs((int16_t)rd - (int16_t)r));
+      maxDev = max(maxDev, (uint16_t)abs((int16_t)gd - (int16_t)g));
+      maxDev = max(maxDev, (uint16_t)abs((int16_t)bd - (int16_t)b));
+    }
+  Serial << F("max deviation fixed vs double: ") << maxDev << endl;
+
+  // HSV to RGB to OKLab and back, on the 12bit scale
+  maxDev = 0;
+  for (uint16_t h = 0; h < 4096; h++)
+    for (uint8_t sv = 1; sv <= 4; sv++)
+    {
+      uint16_t rf, gf, bf;
+      int16_t L, A, B;
+      uint16_t x = min((uint32_t)sv * 16384, (uint32_t)65535);
+      hsv2pcaFixed(h << 4, x, x, &rf, &gf, &bf);
+      hsv2rgbFixed(h << 4, x, x, &r, &g, &b);
+      rgb2oklab(r, g, b, &L, &A, &B);
+      oklab2pca(L, A, B, &r, &g, &b);
+      rf >>= 4, gf >>= 4, bf >>= 4;
+      r >>= 4, g >>= 4, b >>= 4;
+      maxDev = max(maxDev, (uint16_t)abs((int16_t)rf - (int16_t)r));
+      maxDev = max(maxDev, (uint16_t)abs((int16_t)gf - (int16_t)g));
+      maxDev = max(maxDev, (uint16_t)abs((int16_t)bf - (int16_t)b));
+    }
+  Serial << F("max deviation oklab round trip: ") << maxDev << endl;
+
+  (void)sink;
+} // hsvPerfTest
+
+/**********************************************************************
+  effectPerfTest
+  
+  Measure the step cost of every animated effect and compare it to the
+  estimate of the registry. Effects keep their state in globals, so the
+  test only runs on a static mode without accent layers, nothing that
+  runs is disturbed. The frame of the static mode is put back after.
+  Effect debug output is muted while they run.
+**********************************************************************/
+void effectPerfTest(void)
+{
+  const uint16_t frames = 100;
+  effect_st e;
+  rgb_st frame[MAX_STRIPS];
+
+  getEffectRGB(cycleMode, &e);
+  if (numLayers > 1 || e.stepDelay)
+  {
+    Serial << F("effectPerfTest: needs a static mode without layers, e.g. '0'") << endl;
+    return;
+  }
+
+  Serial << F("effectPerfTest: ") << frames << F(" frames, ") << numStrips << F(" strips") << endl;
+
+  memcpy(frame, pca_rgb.rgb, sizeof(rgb_st) * numStrips);
+
+  for (uint8_t i = 0; i < EFFECT_COUNT; i++)
+  {
+    getEffectRGB(i, &e);
+    if (!e.stepDelay)
+      continue;
+
+    effectLog = false;
+    (*e.init)();
+    uint32_t start = ESP.getCycleCount();
+    for (uint16_t f = 0; f < frames; f++)
+      (*e.step)(frameIntervalUs);
+    uint32_t cycles = ESP.getCycleCount() - start;
+    effectLog = true;
+
+    Serial << FPSTR(e.name) << F(": ") << cycles / frames / (F_CPU / 1000000)
+           << F("us/frame, estimate ") << effectCostRGB(i) << F("us") << endl;
+  }
+
+  // No effect running uses the timeline
+  timeline::close();
+
+  memcpy(pca_rgb.rgb, frame, sizeof(rgb_st) * numStrips);
+  frameDirty = true;
+} // effectPerfTest
+
 /**********************************************************************
   serialPerfTest
   
@@ -1,17 +1,134 @@
 #pragma once
 //#include "mqtt.h"
 
+const uint8_t RGB_STRIPS_STR_LEN = 4;
+extern char rgbStrips[];
+
+// Full form of MAX_STRIPS strips, "7F:15/15/15@3 " each
+const uint16_t RGB_TOPOLOGY_STR_LEN = 48 * 14;
+extern char rgbTopology[];
+
+const uint8_t RGB_IIC_MAX_FREQ_STR_LEN = 5;
+extern char rgbIicMaxFreq[];
+
+const uint8_t RGB_CURVE_STR_LEN = 8;
+extern char rgbCurve[];
+
+const uint8_t RGB_CALIB_STR_LEN = 240;
+extern char rgbCalib[];
+
+const uint8_t RGB_BRIGHTNESS_RAMP_STR_LEN = 6;
+extern char rgbBrightnessRamp[];
+
+const uint8_t RGB_POWER_BUDGET_STR_LEN = 6;
+extern char rgbPowerBudget[];
+
+const uint8_t RGB_CHANNEL_CURRENT_STR_LEN = 18;
+extern char rgbChannelCurrent[];
+
+const uint8_t RGB_PWM_FREQ_STR_LEN = 10;
+extern char rgbPwmFreq[];
+
+// IIC clock steps tried by the bus qualification
+const uint8_t IIC_FREQ_STEPS = 6;
+extern const uint16_t iicFreqSteps[];
+const uint16_t IIC_NOT_QUALIFIED = 0xFFFF;
+
+// Telemetry of the RGB engine, sent along with the MQTT heartbeat
+typedef struct
+{
+  uint16_t iicFreq;                       // kHz chosen by the bus qualification
+  uint16_t iicQualErrors[IIC_FREQ_STEPS]; // Errors per step, IIC_NOT_QUALIFIED if not tried
+  uint32_t iicErrors;                     // Bus errors during operation
+  uint32_t outTicks;                      // Ticks of the timed output
+  uint32_t outFrames;                     // Frames sent by the timed output
+  uint32_t outUnderruns;                  // Output ticks without a prepared frame
+  uint32_t outMinUs;                      // Shortest interval between two output frames
+  uint32_t outMaxUs;                      // Longest interval between two output frames
+  uint32_t txLastUs;                      // Bus time of the last frame sent in one transaction
+  uint32_t txMaxUs;                       //   and the longest one
+  uint16_t powerPeakMa;                   // Highest current estimate of a frame
+  uint32_t powerThrottled;                // Frames scaled down by the power limiter
+} rgb_telemetry_st;
+
+extern rgb_telemetry_st rgbTelemetry;
+extern uint32_t outIntervalP99RGB(void);
+
+// Effect registry, one entry per cycle mode. Entries live in flash,
+// read them with getEffectRGB and getEffectParamRGB.
+typedef struct
+{
+  const char *name;      // PROGMEM
+  uint16_t min;
+  uint16_t max;
+  void (*set)(uint16_t);
+} effect_param_st;
+
+typedef struct
+{
+  const char *name;              // PROGMEM, used by MQTT and web
+  char key;                      // Serial command, 0 if none
+  void (*init)(void);
+  void (*step)(uint32_t dtUs);   // dtUs: time since the last frame
+  uint16_t stepDelay;            // Default ms per frame, 0 keeps the current one
+  uint16_t speed;                // Default hue cycles per minute x10, 0 keeps the current one
+  const effect_param_st *params; // PROGMEM
+  uint8_t paramCount;
+  uint16_t costBaseUs;           // Estimated step cost per frame
+  uint16_t costStripUs;          //   plus per strip
+} effect_st;
+
+extern uint8_t effectCountRGB(void);
+extern uint8_t currentEffectRGB(void);
+extern bool getEffectRGB(uint8_t, effect_st *);
+extern bool getEffectParamRGB(uint8_t, uint8_t, effect_param_st *);
+extern int8_t effectIndexRGB(const char *);
+extern uint16_t effectCostRGB(uint8_t);
+extern bool setEffectParamRGB(const char *, uint16_t);
+
 extern void setupRgb();
 extern void loopRgb();
 
 extern void enableRGB(bool);
-extern void setModeRGB(uint8_t);
+extern void setModeRGB(int8_t);
 
 extern void setAbsoluteBrightnessRGB(uint8_t);
 extern void setRelativeBrightnessRGB(int16_t);
+extern void setBrightnessRampRGB(uint16_t);
+extern void setPowerBudgetRGB(uint16_t);
+extern void setPhaseStaggerRGB(bool);
+extern bool setPwmFreqRGB(const char *);
+extern bool setChannelCurrentRGB(const char *);
 
-extern void setAbsoluteSpeedRGB(uint8_t);
+extern void setAbsoluteSpeedRGB(uint16_t);
 extern void setRelativeSpeedRGB(int16_t);
+extern void setFpsRGB(uint8_t);
+
+extern bool setTopologyRGB(uint8_t, const char *);
+extern void setSyncOutputRGB(bool);
+extern void setTimedOutputRGB(bool);
+extern void setIicMaxFreqRGB(uint16_t);
+
+extern bool setLayerRGB(uint8_t, const char *, uint8_t, uint8_t, uint8_t, const char *);
+extern void clearLayersRGB(void);
+
+extern void setTimelineRGB(const char *);
+extern void seekTimelineRGB(uint32_t);
+
+extern void setCloudHoldRGB(uint16_t);
+extern void setCloudDurationRGB(uint16_t);
+extern void setCloudFadeRGB(uint16_t);
+extern void setDitherRGB(uint16_t);
+extern bool setCurveRGB(const char *);
+extern bool setCalibRGB(const char *);
+
+// Check configuration strings as the setters above take them, nothing
+// is applied. For the configuration form.
+extern bool checkTopologyRGB(uint8_t, const char *);
+extern bool checkCurveRGB(const char *);
+extern bool checkCalibRGB(const char *);
+extern bool checkPwmFreqRGB(const char *);
+extern bool checkChannelCurrentRGB(const char *);
 
 extern void enableBeepRGB(void);
 extern void disableBeepRGB(void);
@@ -0,0 +1,373 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <Streaming.h>
+
+#include "global.h"
+#include "timeline.h"
+
+namespace timeline {
+
+char timelineFile[TIMELINE_FILE_STR_LEN] = "/timeline.btl";
+
+const uint8_t HEADER_SIZE = 16;
+const uint8_t KEYFRAME_HEADER_SIZE = 5;
+
+typedef struct
+{
+  uint8_t strips;
+  uint16_t keyframes;
+  uint32_t duration;   // ms
+  uint16_t stride;
+  uint16_t entries;
+  uint32_t dataOffset; // First keyframe
+  uint16_t recordSize; // Bytes per keyframe
+} header_st;
+
+typedef struct
+{
+  uint16_t index;
+  uint32_t time; // ms
+  uint8_t easing;
+  uint8_t rgb[TIMELINE_MAX_STRIPS * 3];
+} keyframe_st;
+
+// Only the two keyframes around the play position are in RAM
+File file;
+header_st hdr;
+keyframe_st kfA; // At or before the play position
+keyframe_st kfB; // After the play position
+uint32_t posMs = 0;
+uint16_t posUs = 0; // Fraction of posMs
+bool ready = false;
+
+static uint32_t le32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t le16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+//
+// Called by main setup
+//
+void setupTimeline()
+{
+  Serial << F("Setup Timeline") << endl;
+
+  if (!LittleFS.begin())
+    Serial << F("Timeline: LittleFS mount failed") << endl;
+} // setupTimeline
+
+//
+// Read keyframe k into kf, a single small read
+//
+static bool readKeyframe(uint16_t k, keyframe_st *kf)
+{
+  uint8_t buff[KEYFRAME_HEADER_SIZE];
+
+  if (!file.seek(hdr.dataOffset + (uint32_t)k * hdr.recordSize) ||
+      file.read(buff, sizeof(buff)) != sizeof(buff) ||
+      file.read(kf->rgb, hdr.strips * 3) != (size_t)hdr.strips * 3)
+  {
+    Serial << F("Timeline: read error at keyframe ") << k << endl;
+    ready = false;
+    return false;
+  }
+
+  kf->index = k;
+  kf->time = le32(&buff[0]);
+  kf->easing = buff[4];
+
+  // The first keyframe is at 0, all are below the duration
+  if ((k == 0) ? kf->time != 0 : kf->time >= hdr.duration)
+  {
+    Serial << F("Timeline: keyframe ") << k << F(" at ") << kf->time << F("ms out of range") << endl;
+    ready = false;
+    return false;
+  }
+  return true;
+} // readKeyframe
+
+//
+// kfB was read as the successor of kfA. Times ascend, so no fade has a
+// length of 0. Checked as render and seek read the keyframes, open
+// does not read them all, seek stays O(log n).
+//
+static bool checkOrder()
+{
+  if (kfB.index && kfB.time <= kfA.time)
+  {
+    Serial << F("Timeline: keyframe ") << kfB.index << F(" at ") << kfB.time << F("ms out of order") << endl;
+    ready = false;
+    return false;
+  }
+  return true;
+} // checkOrder
+
+//
+// Index entries ascend from 0 and stay below the duration, so the
+// binary search of seek is sound. Reads the index block only, in
+// small chunks, the keyframes are checked as they are read.
+//
+static bool checkIndex()
+{
+  uint8_t buff[64];
+  uint32_t last = 0;
+
+  if (!file.seek(HEADER_SIZE))
+    return false;
+
+  for (uint16_t e = 0; e < hdr.entries;)
+  {
+    uint16_t n = hdr.entries - e;
+    if (n > sizeof(buff) / 4)
+      n = sizeof(buff) / 4;
+    if (file.read(buff, n * 4) != (size_t)n * 4)
+      return false;
+
+    for (uint16_t i = 0; i < n; i++, e++)
+    {
+      uint32_t time = le32(&buff[i * 4]);
+      if ((e == 0) ? time != 0 : time <= last || time >= hdr.duration)
+      {
+        Serial << F("Timeline: index entry ") << e << F(" at ") << time << F("ms out of order") << endl;
+        return false;
+      }
+      last = time;
+    }
+  }
+  return true;
+} // checkIndex
+
+//
+// Open a timeline file and start at its beginning
+//
+bool open(const char *path)
+{
+  uint8_t buff[HEADER_SIZE];
+
+  close();
+
+  file = LittleFS.open(path, "r");
+  if (!file)
+  {
+    Serial << F("Timeline: can not open ") << path << endl;
+    return false;
+  }
+
+  if (file.read(buff, sizeof(buff)) != sizeof(buff) || le32(&buff[0]) != TIMELINE_MAGIC || buff[4] != TIMELINE_VERSION)
+  {
+    Serial << F("Timeline: ") << path << F(" is not a timeline") << endl;
+    close();
+    return false;
+  }
+
+  hdr.strips = buff[5];
+  hdr.keyframes = le16(&buff[6]);
+  hdr.duration = le32(&buff[8]);
+  hdr.stride = le16(&buff[12]);
+  hdr.entries = le16(&buff[14]);
+  hdr.dataOffset = HEADER_SIZE + (uint32_t)hdr.entries * 4;
+  hdr.recordSize = KEYFRAME_HEADER_SIZE + hdr.strips * 3;
+
+  if (!hdr.strips || hdr.strips > TIMELINE_MAX_STRIPS || !hdr.keyframes || !hdr.duration || !hdr.stride ||
+      hdr.entries != (hdr.keyframes + hdr.stride - 1) / hdr.stride ||
+      file.size() < hdr.dataOffset + (uint32_t)hdr.keyframes * hdr.recordSize)
+  {
+    Serial << F("Timeline: ") << path << F(" has an invalid header") << endl;
+    close();
+    return false;
+  }
+
+  if (!checkIndex())
+  {
+    Serial << F("Timeline: ") << path << F(" has an invalid index") << endl;
+    close();
+    return false;
+  }
+
+  ready = true;
+
+  Serial << F("Timeline: ") << path << F(" ") << hdr.keyframes << F(" keyframes, ")
+         << hdr.strips << F(" strips, ") << hdr.duration << F("ms") << endl;
+
+  return seek(0);
+} // open
+
+void close()
+{
+  if (file)
+    file.close();
+  ready = false;
+} // close
+
+//
+// Jump to ms. Binary search on the index block, then a linear scan of
+// at most stride keyframes. O(log n) small reads.
+//
+bool seek(uint32_t ms)
+{
+  if (!ready)
+    return false;
+
+  ms %= hdr.duration;
+
+  // Last index entry with a time <= ms, entry 0 is at 0ms
+  uint16_t lo = 0;
+  uint16_t hi = hdr.entries;
+  uint32_t loTime = 0;
+  while (hi - lo > 1)
+  {
+    uint16_t mid = (lo + hi) / 2;
+    uint8_t buff[4];
+
+    if (!file.seek(HEADER_SIZE + (uint32_t)mid * 4) || file.read(buff, 4) != 4)
+    {
+      ready = false;
+      return false;
+    }
+    if (le32(buff) <= ms)
+    {
+      lo = mid;
+      loTime = le32(buff);
+    }
+    else
+      hi = mid;
+  }
+
+  // Last keyframe with a time <= ms
+  uint16_t k = lo * hdr.stride;
+  if (!readKeyframe(k, &kfA))
+    return false;
+  if (kfA.time != loTime)
+  {
+    Serial << F("Timeline: index entry ") << lo << F(" does not match keyframe ") << k << endl;
+    ready = false;
+    return false;
+  }
+  while (k + 1 < hdr.keyframes)
+  {
+    if (!readKeyframe(k + 1, &kfB) || !checkOrder())
+      return false;
+    if (kfB.time > ms)
+      break;
+    kfA = kfB;
+    k++;
+  }
+
+  // The last keyframe fades into the first one
+  if (k + 1 == hdr.keyframes && !readKeyframe(0, &kfB))
+    return false;
+
+  posMs = ms;
+  posUs = 0;
+  return true;
+} // seek
+
+//
+// Time the fade from kfA to kfB ends
+//
+static uint32_t segmentEnd()
+{
+  return kfB.index ? kfB.time : hdr.duration;
+}
+
+//
+// Eased fraction of the fade, Q16
+//
+static uint32_t ease(uint8_t easing, uint32_t f)
+{
+  switch (easing)
+  {
+  case easeStep:
+    return 0;
+  case easeIn:
+    return ((uint64_t)f * f) >> 16;
+  case easeOut:
+    return 65536 - (((uint64_t)(65536 - f) * (65536 - f)) >> 16);
+  case easeInOut:
+    return ((((uint64_t)f * f) >> 16) * (3 * 65536 - 2 * f)) >> 16;
+  case easeLinear:
+  default:
+    return f;
+  }
+} // ease
+
+//
+// 8 bit to 16 bit, 255 maps to 65535
+//
+static inline int32_t to16(uint8_t v)
+{
+  return (v << 8) | v;
+}
+
+//
+// Advance by dtUs and write strips r, g, b triplets of 16 bit values
+// to rgb. Strips beyond the ones of the timeline stay dark.
+// Returns true only if a value in rgb changed, holds and constant
+// stretches let the panel go idle.
+//
+bool render(uint32_t dtUs, uint16_t *rgb, uint8_t strips)
+{
+  if (!ready)
+    return false;
+
+  // Advance the play position, keep the fraction of a ms. seek drops
+  // it, so it is put back after each seek.
+  uint32_t us = posUs + dtUs;
+  posMs += us / 1000;
+  us %= 1000;
+  posUs = us;
+
+  if (posMs >= hdr.duration)
+  {
+    // Looped, start over
+    if (!seek(posMs % hdr.duration))
+      return false;
+    posUs = us;
+  }
+
+  // Usually there is at most one keyframe to read, a long step seeks
+  for (uint8_t n = 0; posMs >= segmentEnd(); n++)
+  {
+    if (n == 4)
+    {
+      if (!seek(posMs))
+        return false;
+      posUs = us;
+      break;
+    }
+
+    kfA = kfB;
+    if (!readKeyframe((kfB.index + 1) % hdr.keyframes, &kfB) || !checkOrder())
+      return false;
+  }
+
+  uint32_t len = segmentEnd() - kfA.time;
+  uint32_t f = ((uint64_t)(posMs - kfA.time) << 16) / len;
+  f = ease(kfA.easing, f);
+
+  bool changed = false;
+  for (uint8_t i = 0; i < strips * 3; i++)
+  {
+    uint16_t v = 0;
+    if (i < hdr.strips * 3)
+    {
+      int32_t a = to16(kfA.rgb[i]);
+      int32_t b = to16(kfB.rgb[i]);
+      v = a + (((int64_t)(b - a) * f) >> 16);
+    }
+    if (rgb[i] != v)
+    {
+      rgb[i] = v;
+      changed = true;
+    }
+  }
+
+  return changed;
+} // render
+
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+namespace timeline {
+
+/*
+  Keyframe timelines, streamed from LittleFS
+
+  File layout, all numbers little endian
+
+  Header, 16 bytes
+    0  uint32  magic "BTL1"
+    4  uint8   version, 1
+    5  uint8   strips per keyframe
+    6  uint16  number of keyframes
+    8  uint32  duration in ms, the timeline loops after it
+   12  uint16  index stride, keyframes per index entry
+   14  uint16  number of index entries, keyframes / stride rounded up
+
+  Index block, 4 bytes per entry
+       uint32  time in ms of keyframe entry * stride
+
+  Keyframes, 5 + 3 * strips bytes each
+    0  uint32  time in ms, the first one at 0, ascending, below duration
+    4  uint8   easing towards the next keyframe, see easing_t
+    5  uint8   r, g, b of each strip
+
+  The last keyframe fades into the first one at duration.
+*/
+const uint32_t TIMELINE_MAGIC = 0x314C5442; // "BTL1"
+const uint8_t TIMELINE_VERSION = 1;
+const uint8_t TIMELINE_MAX_STRIPS = 48; // MAX_STRIPS of rgb_pwm.cpp, asserted there
+
+enum easing_t
+{
+  easeStep = 0,  // Hold until the next keyframe
+  easeLinear = 1,
+  easeIn = 2,    // Quadratic
+  easeOut = 3,   // Quadratic
+  easeInOut = 4  // Smoothstep
+};
+
+const uint8_t TIMELINE_FILE_STR_LEN = 32;
+extern char timelineFile[];
+
+extern void setupTimeline();
+
+extern bool open(const char *path);
+extern void close();
+extern bool seek(uint32_t ms);
+extern bool render(uint32_t dtUs, uint16_t *rgb, uint8_t strips);
+
+}